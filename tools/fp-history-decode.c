@@ -0,0 +1,204 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Decode the frame history kept by the Xserve front-panel driver, one line
+ * per history period: the wall clock time and the LED values, averaged
+ * over the period and at the 16 levels the history keeps (0, 17 ... 255).
+ *
+ *	fp-history-decode [-x] [file]
+ *
+ * Reads /sys/kernel/debug/xserve-frontpanel/history by default, or a copy
+ * of it pulled from another box. -x prints the frames in hex.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HISTORY_PATH	"/sys/kernel/debug/xserve-frontpanel/history"
+#define HISTORY_VERSION	2
+#define HISTORY_HDR	20
+#define HISTORY_LEVEL	17
+#define HISTORY_RUN_MAX	0x7f
+#define HISTORY_DELTA	0x80
+#define HISTORY_FULL	0x81
+
+/* struct frontpanel_history_chunk, little endian and packed */
+struct chunk {
+	const unsigned char *data;	/* keyframe, then records */
+	uint64_t start_ns;
+	uint32_t seq;
+	unsigned int used, period_ms, channels;
+};
+
+static uint64_t le(const unsigned char *p, int n)
+{
+	uint64_t v = 0;
+
+	while (n--)
+		v = v << 8 | p[n];
+	return v;
+}
+
+static int hex;
+
+static void show(uint64_t ns, const unsigned char *frame, unsigned int channels)
+{
+	time_t sec = ns / 1000000000;
+	char when[32];
+	unsigned int i;
+
+	strftime(when, sizeof(when), "%F %T", localtime(&sec));
+	printf("%s.%03u ", when, (unsigned int)(ns / 1000000 % 1000));
+	for (i = 0; i < channels; i++)
+		printf(hex ? "%02x" : " %3u", frame[i] * HISTORY_LEVEL);
+	putchar('\n');
+}
+
+/* the n-th nibble of a packed run of them, low one first */
+static unsigned int nibble(const unsigned char *p, unsigned int n)
+{
+	return n % 2 ? p[n / 2] >> 4 : p[n / 2] & 0xf;
+}
+
+static void decode(const struct chunk *c)
+{
+	unsigned char frame[256];
+	const unsigned char *p = c->data + c->channels, *end = p + c->used;
+	unsigned int mask_size = (c->channels + 7) / 8, ch, n, changed;
+	unsigned int full_size = (c->channels + 1) / 2;
+	uint64_t ns = c->start_ns, period = c->period_ms * 1000000ULL;
+	const unsigned char *mask, *delta;
+
+	memcpy(frame, c->data, c->channels);
+	show(ns, frame, c->channels);
+
+	while (p < end) {
+		if (*p <= HISTORY_RUN_MAX) {
+			for (n = *p++ + 1; n; n--)
+				show(ns += period, frame, c->channels);
+			continue;
+		}
+
+		if (*p == HISTORY_DELTA) {
+			mask = p + 1;
+			delta = mask + mask_size;
+			if (delta > end)
+				break;
+			for (ch = changed = 0; ch < c->channels; ch++)
+				changed += !!(mask[ch / 8] & 1 << ch % 8);
+			if (delta + (changed + 1) / 2 > end)
+				break;
+			for (ch = n = 0; ch < c->channels; ch++)
+				if (mask[ch / 8] & 1 << ch % 8)
+					/* sign extend the nibble */
+					frame[ch] += (int)(nibble(delta, n++) ^ 8) - 8;
+			p = delta + (changed + 1) / 2;
+		} else if (*p == HISTORY_FULL) {
+			if (p + 1 + full_size > end)
+				break;
+			for (ch = 0; ch < c->channels; ch++)
+				frame[ch] = nibble(p + 1, ch);
+			p += 1 + full_size;
+		} else {
+			fprintf(stderr, "chunk %u: bad record 0x%02x\n", c->seq, *p);
+			return;
+		}
+		show(ns += period, frame, c->channels);
+	}
+	if (p != end)
+		fprintf(stderr, "chunk %u: truncated\n", c->seq);
+}
+
+static int by_seq(const void *a, const void *b)
+{
+	const struct chunk *x = a, *y = b;
+
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = HISTORY_PATH;
+	unsigned char *buf = NULL;
+	size_t len = 0, alloc = 0, size, i, n = 0;
+	struct chunk *chunks;
+	FILE *f;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "x")) != -1) {
+		switch (opt) {
+		case 'x': hex = 1; break;
+		default:
+			fprintf(stderr, "usage: %s [-x] [file]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind < argc)
+		path = argv[optind];
+
+	f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	for (;;) {
+		if (len == alloc) {
+			alloc = alloc ? 2 * alloc : 1 << 20;
+			buf = realloc(buf, alloc);
+			if (!buf) {
+				perror("realloc");
+				return 1;
+			}
+		}
+		size = fread(buf + len, 1, alloc - len, f);
+		if (!size)
+			break;
+		len += size;
+	}
+	fclose(f);
+
+	/* the ring fills from its start, so the first chunk tells the layout */
+	if (len < HISTORY_HDR || !le(buf + 8, 4)) {
+		fprintf(stderr, "%s: no history\n", path);
+		return 1;
+	}
+	size = le(buf + 16, 2);
+	if (buf[19] != HISTORY_VERSION || size <= HISTORY_HDR) {
+		fprintf(stderr, "%s: unknown format\n", path);
+		return 1;
+	}
+
+	chunks = calloc(len / size, sizeof(*chunks));
+	if (!chunks) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i + size <= len; i += size) {
+		struct chunk *c = &chunks[n];
+
+		c->seq = le(buf + i + 8, 4);
+		if (!c->seq)
+			continue;
+		c->start_ns = le(buf + i, 8);
+		c->used = le(buf + i + 12, 2);
+		c->period_ms = le(buf + i + 14, 2);
+		c->channels = buf[i + 18];
+		c->data = buf + i + HISTORY_HDR;
+		if (HISTORY_HDR + c->channels + c->used > size) {
+			fprintf(stderr, "chunk %u: bad size\n", c->seq);
+			continue;
+		}
+		n++;
+	}
+
+	qsort(chunks, n, sizeof(*chunks), by_seq);
+	for (i = 0; i < n; i++)
+		decode(&chunks[i]);
+
+	free(chunks);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+"""
+Check the front-panel sampler against /proc/stat.
+
+Enables the driver's debugfs load log, snapshots /proc/stat every interval
+and, at the end, compares the load the driver gave each LED, averaged over
+the interval, with the busy fraction /proc/stat accounted for the same CPU
+and interval, separately for each backend: polled, and the sched hooks of
+sched_hooks=1. Run the panel in cpu mode with a controlled load alongside,
+e.g.
+
+    stress-ng --cpu 4 --cpu-load 50 --timeout 60 &
+    fp-loadcheck.py -d 60
+
+Errors are in percentage points of one CPU. /proc/stat counts in USER_HZ
+ticks, so short windows carry a quantisation error of about
+100 / (USER_HZ * interval) points, and the LED load one of 100 / 255.
+"""
+
+import argparse
+import os
+import time
+
+DEBUGFS = "/sys/kernel/debug/xserve-frontpanel"
+
+
+def read_proc_stat():
+    """Return {cpu: (busy, total)} in USER_HZ ticks, iowait counted idle."""
+    cpus = {}
+    with open("/proc/stat") as f:
+        for line in f:
+            if not line.startswith("cpu") or line.startswith("cpu "):
+                continue
+            fields = line.split()
+            vals = [int(v) for v in fields[1:9]]
+            idle = vals[3] + vals[4]
+            cpus[int(fields[0][3:])] = (sum(vals) - idle, sum(vals))
+    return cpus
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(p / 100.0 * len(values)))]
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("-d", "--duration", type=float, default=30,
+                    help="seconds to run (30)")
+    ap.add_argument("-i", "--interval", type=float, default=1,
+                    help="comparison window in seconds (1)")
+    args = ap.parse_args()
+
+    records = {}
+    snapshots = []
+
+    def drain(log):
+        for line in log.read().splitlines():
+            fields = line.split()
+            wall_us, cpu, window_us, _, load = (int(v) for v in fields[:5])
+            records.setdefault((cpu, fields[5]), []).append(
+                (wall_us - window_us, wall_us, load / 255.0))
+
+    with open(os.path.join(DEBUGFS, "loadlog_enable"), "w") as f:
+        f.write("1")
+    try:
+        with open(os.path.join(DEBUGFS, "loadlog")) as log:
+            drain(log)          # discard what was logged before we started
+            records.clear()
+            end = time.monotonic() + args.duration
+            while True:
+                now = time.monotonic()
+                snapshots.append((int(now * 1e6), read_proc_stat()))
+                drain(log)
+                if now >= end:
+                    break
+                time.sleep(args.interval)
+            drain(log)
+    finally:
+        with open(os.path.join(DEBUGFS, "loadlog_enable"), "w") as f:
+            f.write("0")
+
+    errors = {}
+    for (t0, s0), (t1, s1) in zip(snapshots, snapshots[1:]):
+        for (cpu, backend), recs in records.items():
+            if cpu not in s0 or cpu not in s1:
+                continue
+            total = s1[cpu][1] - s0[cpu][1]
+            if not total:
+                continue
+            ref = (s1[cpu][0] - s0[cpu][0]) / total
+
+            # overlap-weighted mean of the driver's windows
+            weight = busy = 0.0
+            for start, stop, frac in recs:
+                overlap = min(stop, t1) - max(start, t0)
+                if overlap > 0:
+                    weight += overlap
+                    busy += overlap * frac
+            if weight < 0.5 * (t1 - t0):
+                continue
+            errors.setdefault((cpu, backend), []).append(
+                100.0 * (busy / weight - ref))
+
+    if not errors:
+        print("no overlapping samples, is the panel attached?")
+        return 1
+
+    def show(name, e):
+        print("%-9s %8d %7.2f %7.2f %7.2f %8.2f" % (
+            name, len(e), sum(e) / len(e), percentile(e, 50),
+            percentile(e, 95), max(abs(v) for v in e)))
+
+    print("cpu        windows    mean     p50     p95  max|err|")
+    every = {}
+    for cpu, backend in sorted(errors):
+        e = errors[(cpu, backend)]
+        every.setdefault(backend, []).extend(e)
+        show("%3d %s" % (cpu, backend), e)
+    for backend in sorted(every):
+        show("all %s" % backend, every[backend])
+    return 0
+
+
+if __name__ == "__main__":
+    raise SystemExit(main())
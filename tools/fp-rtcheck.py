@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+"""
+Measure the scheduling latency the front-panel driver adds.
+
+Runs "rtla timerlat top" with the module unloaded, then again with it
+loaded at 50 Hz, and prints the worst IRQ and thread latencies of both
+runs per CPU and their difference. The 50 Hz module is built from this
+tree with "make CPU_SAMPLING_RATE=20" unless -k names one. Run as root
+with the panel attached and a realistic load alongside; the installed
+module is loaded again at the end if it was loaded at the start.
+
+    fp-rtcheck.py -d 5m
+"""
+
+import argparse
+import os
+import re
+import subprocess
+
+MODULE = "xserve-frontpanel"
+TREE = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+ROW = re.compile(r"^\s*(\d+)\s+#\d+\s*\|")
+
+
+def loaded():
+    return os.path.exists("/sys/module/" + MODULE.replace("-", "_"))
+
+
+def build():
+    subprocess.run(["make", "CPU_SAMPLING_RATE=20"], cwd=TREE, check=True,
+                   env=dict(os.environ, PWD=TREE))
+    return os.path.join(TREE, MODULE + ".ko")
+
+
+def timerlat(duration, cpus):
+    """Return {cpu: (irq max, thread max)} in us."""
+    cmd = ["rtla", "timerlat", "top", "-q", "-d", duration]
+    if cpus:
+        cmd += ["-c", cpus]
+    out = subprocess.run(cmd, check=True, capture_output=True,
+                         text=True).stdout
+    worst = {}
+    for line in out.splitlines():
+        m = ROW.match(line)
+        if not m:
+            continue
+        groups = line.split("|")
+        worst[int(m.group(1))] = (int(groups[1].split()[-1]),
+                                  int(groups[2].split()[-1]))
+    if not worst:
+        raise SystemExit("no latencies in rtla output:\n" + out)
+    return worst
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("-d", "--duration", default="5m",
+                    help="length of each run, in rtla's format (5m)")
+    ap.add_argument("-c", "--cpus", help="CPUs to measure, in rtla's format")
+    ap.add_argument("-k", "--module",
+                    help="module to measure (built at 50 Hz from this tree)")
+    args = ap.parse_args()
+
+    ko = args.module or build()
+    was_loaded = loaded()
+    if was_loaded:
+        subprocess.run(["rmmod", MODULE], check=True)
+    try:
+        print("timerlat without the module, %s" % args.duration)
+        base = timerlat(args.duration, args.cpus)
+        subprocess.run(["insmod", ko], check=True)
+        try:
+            print("timerlat with %s, %s" % (ko, args.duration))
+            panel = timerlat(args.duration, args.cpus)
+        finally:
+            subprocess.run(["rmmod", MODULE], check=True)
+    finally:
+        if was_loaded:
+            subprocess.run(["modprobe", MODULE], check=True)
+
+    print("%4s %18s %18s %18s" % ("cpu", "irq max (us)", "thread max (us)",
+                                  "diff irq/thread"))
+    for cpu in sorted(base.keys() & panel.keys()):
+        (bi, bt), (pi, pt) = base[cpu], panel[cpu]
+        print("%4d %8d -> %-7d %8d -> %-7d %+8d / %+d" %
+              (cpu, bi, pi, bt, pt, pi - bi, pt - bt))
+    bi, bt = (max(v[i] for v in base.values()) for i in (0, 1))
+    pi, pt = (max(v[i] for v in panel.values()) for i in (0, 1))
+    print("%4s %8d -> %-7d %8d -> %-7d %+8d / %+d" %
+          ("all", bi, pi, bt, pt, pi - bi, pt - bt))
+
+
+if __name__ == "__main__":
+    main()
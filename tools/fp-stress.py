@@ -0,0 +1,276 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+"""
+Stress the front-panel driver's lifecycle paths against each other.
+
+Flips the panel's display mode and view from -w writer threads while
+another thread unbinds and rebinds the interface, resets the device with
+USBDEVFS_RESET and, with -s, runs the machine's devices through suspend
+and resume via /sys/power/pm_test (CONFIG_PM_DEBUG). Prints the frames
+submitted and urgent frames acknowledged per second from the debugfs stats
+every interval, so a panel that stops updating after one of the cycles
+shows as a run of zeroes. Run as root on a kernel built with lockdep,
+KASAN or KCSAN and check dmesg afterwards; the taint flags are compared at
+the end.
+
+The sampler is the only thread posting frames to a panel, so writers only
+race it with the mode and view changes. To push the submission path
+harder, -u drops anomaly_sigma to 1 and runs a process per CPU that
+switches between spinning and sleeping, so CPUs keep tripping alerts and
+urgent frames unlink the queued ones, and -r builds the module from this
+tree with a sampling period of that many ms and runs it in place of the
+installed one, so ticks outrun the completions and frames are put back
+for a completion to send. Posting from many CPUs at once is what the
+xserve-frontpanel-bench module measures.
+
+    fp-stress.py -d 300 -s -u -r 1
+"""
+
+import argparse
+import fcntl
+import multiprocessing
+import os
+import random
+import subprocess
+import threading
+import time
+
+MODULE = "xserve-frontpanel"
+TREE = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+DRIVER = "/sys/bus/usb/drivers/xserve-frontpanel"
+DEVICES = "/sys/bus/usb/devices"
+STATS = "/sys/kernel/debug/xserve-frontpanel/stats"
+SIGMA = "/sys/module/xserve_frontpanel/parameters/anomaly_sigma"
+USBDEVFS_RESET = ord("U") << 8 | 20             # _IO('U', 20)
+
+
+def write(path, value):
+    with open(path, "w") as f:
+        f.write(value)
+
+
+def read(path):
+    with open(path) as f:
+        return f.read()
+
+
+def counters():
+    """Return (frames_submitted, urgent_frames) from the debugfs stats."""
+    stats = {}
+    for line in read(STATS).splitlines():
+        key, _, value = line.partition(":")
+        stats[key] = int(value)
+    return stats.get("frames_submitted", 0), stats.get("urgent_frames", 0)
+
+
+def find_interface(wait=0):
+    deadline = time.monotonic() + wait
+    while True:
+        for name in sorted(os.listdir(DRIVER)):
+            if ":" in name:
+                return name
+        if time.monotonic() >= deadline:
+            raise SystemExit("%s: no panel bound" % DRIVER)
+        time.sleep(0.1)
+
+
+def build(rate):
+    subprocess.run(["make", "CPU_SAMPLING_RATE=%d" % rate], cwd=TREE,
+                   check=True, env=dict(os.environ, PWD=TREE))
+    return os.path.join(TREE, MODULE + ".ko")
+
+
+def loaded():
+    return os.path.exists("/sys/module/" + MODULE.replace("-", "_"))
+
+
+def burn(cpu, stop):
+    """Swing one CPU's load between idle and busy, to trip its alert."""
+    os.sched_setaffinity(0, [cpu])
+    while not stop.is_set():
+        end = time.monotonic() + random.uniform(0.05, 0.5)
+        if random.random() < 0.5:
+            while time.monotonic() < end:
+                pass
+        else:
+            time.sleep(end - time.monotonic())
+
+
+def views():
+    """Views to write: some CPU lists and each online node."""
+    cpus = sorted(os.sched_getaffinity(0))
+    lists = [",".join(map(str, random.sample(cpus, random.randint(
+        1, min(16, len(cpus)))))) for _ in range(8)]
+    online = read("/sys/devices/system/node/online").strip()
+    for part in online.split(","):
+        first, _, last = part.partition("-")
+        lists += ["node%d" % n for n in range(int(first), int(last or first) + 1)]
+    return lists
+
+
+class Stress:
+    def __init__(self, intf, modes, suspend):
+        self.intf = intf
+        self.udev = os.path.join(DEVICES, intf.split(":")[0])
+        self.modes = modes
+        self.suspend = suspend
+        self.views = views()
+        self.stop = threading.Event()
+        self.lock = threading.Lock()
+        self.counts = dict.fromkeys(
+            ("writes", "rebinds", "resets", "suspends", "errors"), 0)
+
+    def flip_modes(self):
+        """Write a random mode or view, as one of several writers."""
+        intf = os.path.join(DEVICES, self.intf)
+        while not self.stop.is_set():
+            if random.random() < 0.5:
+                path, value = "mode", random.choice(self.modes)
+            else:
+                path, value = "view", random.choice(self.views)
+            try:
+                write(os.path.join(intf, path), value)
+                with self.lock:
+                    self.counts["writes"] += 1
+            except OSError:
+                # unbound, or a mode this kernel refuses
+                pass
+            time.sleep(random.uniform(0, 0.02))
+
+    def rebind(self):
+        write(os.path.join(DRIVER, "unbind"), self.intf)
+        time.sleep(random.uniform(0, 0.2))
+        write(os.path.join(DRIVER, "bind"), self.intf)
+        self.counts["rebinds"] += 1
+
+    def reset(self):
+        node = "/dev/bus/usb/%03d/%03d" % (
+            int(read(os.path.join(self.udev, "busnum"))),
+            int(read(os.path.join(self.udev, "devnum"))))
+        fd = os.open(node, os.O_WRONLY)
+        try:
+            fcntl.ioctl(fd, USBDEVFS_RESET, 0)
+        finally:
+            os.close(fd)
+        self.counts["resets"] += 1
+
+    def suspend_devices(self):
+        write("/sys/power/pm_test", "devices")
+        try:
+            write("/sys/power/state", "freeze")
+        finally:
+            write("/sys/power/pm_test", "none")
+        self.counts["suspends"] += 1
+
+    def cycle(self):
+        actions = [self.rebind, self.reset]
+        if self.suspend:
+            actions.append(self.suspend_devices)
+        while not self.stop.is_set():
+            try:
+                random.choice(actions)()
+            except OSError as e:
+                self.counts["errors"] += 1
+                print("error: %s" % e)
+            time.sleep(random.uniform(0.1, 1))
+
+    def rebound(self):
+        """Leave the panel bound, as it was found."""
+        if not os.path.exists(os.path.join(DRIVER, self.intf)):
+            write(os.path.join(DRIVER, "bind"), self.intf)
+
+
+def run(args):
+    intf = find_interface(wait=5)
+    mode_path = os.path.join(DEVICES, intf, "mode")
+    view_path = os.path.join(DEVICES, intf, "view")
+    shown = read(mode_path).split()
+    if args.modes:
+        modes = args.modes.split(",")
+    else:
+        modes = [m.strip("[]") for m in shown]
+    initial = next(m.strip("[]") for m in shown if m.startswith("["))
+    initial_view = read(view_path).strip()
+    sigma = read(SIGMA).strip()
+    tainted = int(read("/proc/sys/kernel/tainted"))
+
+    stress = Stress(intf, modes, args.suspend)
+    threads = [threading.Thread(target=stress.flip_modes)
+               for _ in range(args.writers)]
+    threads.append(threading.Thread(target=stress.cycle))
+    burners, burning = [], multiprocessing.Event()
+    if args.urgent:
+        write(SIGMA, "1")
+        burners = [multiprocessing.Process(target=burn, args=(cpu, burning))
+                   for cpu in sorted(os.sched_getaffinity(0))]
+    for t in threads + burners:
+        t.start()
+
+    print("%8s %10s %10s %8s %8s %8s %8s" %
+          ("time", "frames/s", "urgent/s", "writes", "rebinds", "resets",
+           "suspends"))
+    start = last_t = time.monotonic()
+    last, last_urgent = counters()
+    try:
+        while last_t - start < args.duration:
+            time.sleep(args.interval)
+            now, (frames, urgent) = time.monotonic(), counters()
+            print("%8.1f %10.1f %10.1f %8d %8d %8d %8d" %
+                  (now - start, (frames - last) / (now - last_t),
+                   (urgent - last_urgent) / (now - last_t),
+                   stress.counts["writes"], stress.counts["rebinds"],
+                   stress.counts["resets"], stress.counts["suspends"]))
+            last, last_urgent, last_t = frames, urgent, now
+    except KeyboardInterrupt:
+        pass
+    finally:
+        stress.stop.set()
+        burning.set()
+        for t in threads + burners:
+            t.join()
+        stress.rebound()
+        write(mode_path, initial)
+        write(view_path, initial_view)
+        write(SIGMA, sigma)
+
+    now = int(read("/proc/sys/kernel/tainted"))
+    print("errors: %d, taint: %#x -> %#x%s" %
+          (stress.counts["errors"], tainted, now,
+           "" if now == tainted else ", check dmesg"))
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("-d", "--duration", type=float, default=60,
+                    help="seconds to run (60)")
+    ap.add_argument("-i", "--interval", type=float, default=1,
+                    help="report interval in seconds (1)")
+    ap.add_argument("-m", "--modes",
+                    help="comma separated modes to flip between (all)")
+    ap.add_argument("-w", "--writers", type=int, default=4,
+                    help="threads writing mode and view (4)")
+    ap.add_argument("-u", "--urgent", action="store_true",
+                    help="swing the CPU loads with anomaly_sigma=1 for urgent frames")
+    ap.add_argument("-r", "--rate", type=int,
+                    help="run a module built with this sampling period in ms")
+    ap.add_argument("-s", "--suspend", action="store_true",
+                    help="also cycle suspend through /sys/power/pm_test")
+    args = ap.parse_args()
+
+    ko = build(args.rate) if args.rate else None
+    was_loaded = loaded()
+    if ko:
+        if was_loaded:
+            subprocess.run(["rmmod", MODULE], check=True)
+        subprocess.run(["insmod", ko], check=True)
+    try:
+        run(args)
+    finally:
+        if ko:
+            subprocess.run(["rmmod", MODULE], check=True)
+            if was_loaded:
+                subprocess.run(["modprobe", MODULE], check=True)
+
+
+if __name__ == "__main__":
+    main()
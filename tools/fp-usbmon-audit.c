@@ -0,0 +1,407 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Audit what the Xserve front-panel driver puts on the bus, as seen by the
+ * host controller through the binary usbmon interface.
+ *
+ * Needs the usbmon module and root:
+ *	modprobe usbmon
+ *	fp-usbmon-audit [-v] [-b bus] [-d dev] [-B burst_ms] [-n frames]
+ *			[-L cpu [-l led] [-t level] [-r runs]]
+ *
+ * Without -b/-d the panel is looked up in sysfs. Interrupt with ^C to get
+ * the summary.
+ *
+ * -L measures load-to-LED latency: on an otherwise idle machine, it starts a
+ * busy loop pinned to the CPU, takes the time of the first frame that puts
+ * the CPU's LED (-l, by default the CPU's number) at or above the level
+ * (-t, 128), stops the loop, waits for the LED to fall back and a second of
+ * quiet, and repeats -r times (10).
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#define PANEL_VENDOR	0x05ac
+#define PANEL_PRODUCT	0x8261
+#define PANEL_DATA_SIZE	32
+#define PANEL_CHANNELS	16
+
+#define HIST_BUCKETS	24
+#define MAX_IN_FLIGHT	64
+
+/* from Documentation/usb/usbmon.rst, the 64 byte MON_IOCX_GETX header */
+struct usbmon_packet {
+	uint64_t id;
+	unsigned char type;
+	unsigned char xfer_type;
+	unsigned char epnum;
+	unsigned char devnum;
+	unsigned short busnum;
+	char flag_setup;
+	char flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int status;
+	unsigned int length;
+	unsigned int len_cap;
+	unsigned char setup[8];
+	int interval;
+	int start_frame;
+	unsigned int xfer_flags;
+	unsigned int ndesc;
+};
+
+struct mon_get_arg {
+	struct usbmon_packet *hdr;
+	void *data;
+	size_t alloc;
+};
+
+#define MON_IOC_MAGIC	0x92
+#define MON_IOCX_GETX	_IOW(MON_IOC_MAGIC, 10, struct mon_get_arg)
+
+#define XFER_BULK	3
+
+struct hist {
+	uint64_t n, sum, min, max;
+	uint64_t bucket[HIST_BUCKETS];	/* log2 of microseconds */
+};
+
+static struct {
+	struct hist interval;		/* submit to submit */
+	struct hist latency;		/* submit to complete */
+	struct hist burst;		/* frames per burst */
+	struct hist step;		/* busy loop start to LED lit */
+	uint64_t frames, duplicates, errors, max_in_flight, step_misses;
+} audit;
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void hist_add(struct hist *h, uint64_t v)
+{
+	unsigned int b = 0;
+
+	if (!h->n || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->n++;
+	h->sum += v;
+	while (b < HIST_BUCKETS - 1 && (v >> b))
+		b++;
+	h->bucket[b]++;
+}
+
+static void hist_print(const char *name, const char *unit, const struct hist *h)
+{
+	unsigned int b;
+
+	if (!h->n) {
+		printf("%s: none\n", name);
+		return;
+	}
+	printf("%s: n=%llu min=%llu avg=%llu max=%llu %s\n", name,
+	       (unsigned long long)h->n, (unsigned long long)h->min,
+	       (unsigned long long)(h->sum / h->n),
+	       (unsigned long long)h->max, unit);
+	for (b = 0; b < HIST_BUCKETS; b++)
+		if (h->bucket[b])
+			printf("  < %8llu %s: %llu\n", 1ULL << b, unit,
+			       (unsigned long long)h->bucket[b]);
+}
+
+static int read_sysfs_int(const char *dir, const char *file, int base)
+{
+	char path[512], buf[32];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/%s", dir, file);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, sizeof(buf), f))
+		buf[0] = 0;
+	fclose(f);
+
+	return buf[0] ? (int)strtol(buf, NULL, base) : -1;
+}
+
+static int find_panel(int *bus, int *dev)
+{
+	struct dirent *de;
+	DIR *d = opendir("/sys/bus/usb/devices");
+
+	if (!d)
+		return -1;
+	while ((de = readdir(d))) {
+		if (read_sysfs_int(de->d_name, "idVendor", 16) != PANEL_VENDOR ||
+		    read_sysfs_int(de->d_name, "idProduct", 16) != PANEL_PRODUCT)
+			continue;
+		*bus = read_sysfs_int(de->d_name, "busnum", 10);
+		*dev = read_sysfs_int(de->d_name, "devnum", 10);
+		closedir(d);
+		return 0;
+	}
+	closedir(d);
+
+	return -1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-v] [-b bus] [-d dev] [-B burst_ms] [-n frames]\n"
+		"\t[-L cpu [-l led] [-t level] [-r runs]]\n", prog);
+	exit(1);
+}
+
+/* usbmon stamps events with the wall clock */
+static uint64_t now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* the load-to-LED step test, driven by the frames and a 100 ms tick */
+static struct {
+	int cpu, led, level, runs;
+	pid_t busy;			/* the busy loop, 0 while quiet */
+	uint64_t since;			/* busy loop start, or quiet since */
+	int lit;			/* the LED's last value is >= level */
+} step = { .cpu = -1, .led = -1, .level = 128, .runs = 10 };
+
+static void step_start(void)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(step.cpu, &set);
+	step.busy = fork();
+	if (step.busy < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (!step.busy) {
+		if (sched_setaffinity(0, sizeof(set), &set))
+			_exit(1);
+		for (;;)
+			;
+	}
+	step.since = now_us();
+}
+
+static void step_stop(void)
+{
+	kill(step.busy, SIGKILL);
+	waitpid(step.busy, NULL, 0);
+	step.busy = 0;
+	step.since = now_us();
+}
+
+static void step_frame(uint64_t ts, const unsigned char *data)
+{
+	step.lit = data[step.led] >= step.level;
+	if (!step.busy) {
+		if (step.lit)
+			step.since = ts;
+		return;
+	}
+	if (step.lit && ts >= step.since) {
+		hist_add(&audit.step, ts - step.since);
+		step_stop();
+		step.runs--;
+	}
+}
+
+static void step_tick(void)
+{
+	uint64_t now = now_us();
+
+	if (step.busy && now - step.since > 5000000) {
+		audit.step_misses++;
+		step_stop();
+		step.runs--;
+	} else if (!step.busy && step.runs > 0 && !step.lit &&
+		   now - step.since > 1000000) {
+		step_start();
+	}
+	if (step.runs <= 0 && !step.busy)
+		stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct { uint64_t id, ts; } in_flight[MAX_IN_FLIGHT];
+	unsigned char data[PANEL_DATA_SIZE], prev[PANEL_DATA_SIZE];
+	struct usbmon_packet hdr;
+	struct mon_get_arg arg = { &hdr, data, sizeof(data) };
+	uint64_t last_submit = 0, burst = 0, limit = 0, burst_us = 2000;
+	int bus = -1, dev = -1, verbose = 0, have_prev = 0, fd, opt;
+	unsigned int n_flight = 0, i;
+	char path[64];
+
+	while ((opt = getopt(argc, argv, "vb:d:B:n:L:l:t:r:")) != -1) {
+		switch (opt) {
+		case 'v': verbose = 1; break;
+		case 'b': bus = atoi(optarg); break;
+		case 'd': dev = atoi(optarg); break;
+		case 'B': burst_us = strtoull(optarg, NULL, 0) * 1000; break;
+		case 'n': limit = strtoull(optarg, NULL, 0); break;
+		case 'L': step.cpu = atoi(optarg); break;
+		case 'l': step.led = atoi(optarg); break;
+		case 't': step.level = atoi(optarg); break;
+		case 'r': step.runs = atoi(optarg); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (step.cpu >= 0 && step.led < 0)
+		step.led = step.cpu;
+	if (step.led >= PANEL_CHANNELS)
+		usage(argv[0]);
+
+	if (bus < 0 || dev < 0) {
+		int found_bus, found_dev;
+
+		if (find_panel(&found_bus, &found_dev)) {
+			fprintf(stderr, "front panel not found, pass -b and -d\n");
+			return 1;
+		}
+		if (bus < 0)
+			bus = found_bus;
+		if (dev < 0)
+			dev = found_dev;
+	}
+
+	snprintf(path, sizeof(path), "/dev/usbmon%d", bus);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+
+	if (step.cpu >= 0)
+		step.since = now_us();
+
+	while (!stop && (!limit || audit.frames < limit)) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		uint64_t ts;
+
+		if (step.cpu >= 0) {
+			step_tick();
+			if (poll(&pfd, 1, 100) <= 0)
+				continue;
+		}
+		if (ioctl(fd, MON_IOCX_GETX, &arg) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("MON_IOCX_GETX");
+			break;
+		}
+
+		/* bulk OUT to the panel only */
+		if (hdr.busnum != bus || hdr.devnum != dev ||
+		    hdr.xfer_type != XFER_BULK || (hdr.epnum & 0x80))
+			continue;
+
+		ts = (uint64_t)hdr.ts_sec * 1000000 + hdr.ts_usec;
+
+		if (hdr.type == 'S') {
+			unsigned int len = hdr.len_cap < sizeof(data) ? hdr.len_cap : sizeof(data);
+
+			audit.frames++;
+			if (last_submit) {
+				hist_add(&audit.interval, ts - last_submit);
+				if (ts - last_submit < burst_us) {
+					burst++;
+				} else {
+					hist_add(&audit.burst, burst);
+					burst = 1;
+				}
+			} else {
+				burst = 1;
+			}
+			last_submit = ts;
+
+			if (have_prev && !memcmp(prev, data, len))
+				audit.duplicates++;
+			memcpy(prev, data, len);
+			have_prev = 1;
+			if (step.cpu >= 0 && len > (unsigned int)step.led)
+				step_frame(ts, data);
+
+			if (n_flight < MAX_IN_FLIGHT) {
+				in_flight[n_flight].id = hdr.id;
+				in_flight[n_flight].ts = ts;
+				n_flight++;
+			}
+			if (n_flight > audit.max_in_flight)
+				audit.max_in_flight = n_flight;
+
+			if (verbose) {
+				printf("%llu.%06u S ep%u", (unsigned long long)hdr.ts_sec,
+				       (unsigned int)hdr.ts_usec, hdr.epnum);
+				for (i = 0; i < len && i < PANEL_CHANNELS; i++)
+					printf(" %02x", data[i]);
+				printf("\n");
+			}
+		} else if (hdr.type == 'C' || hdr.type == 'E') {
+			if (hdr.status)
+				audit.errors++;
+			for (i = 0; i < n_flight; i++) {
+				if (in_flight[i].id != hdr.id)
+					continue;
+				hist_add(&audit.latency, ts - in_flight[i].ts);
+				in_flight[i] = in_flight[--n_flight];
+				break;
+			}
+			if (verbose && hdr.status)
+				printf("%llu.%06u %c status %d\n", (unsigned long long)hdr.ts_sec,
+				       (unsigned int)hdr.ts_usec, hdr.type, hdr.status);
+		}
+	}
+	if (burst)
+		hist_add(&audit.burst, burst);
+	if (step.busy)
+		step_stop();
+
+	printf("bus %d device %d: %llu frames, %llu duplicates, %llu errors, max %llu in flight\n",
+	       bus, dev, (unsigned long long)audit.frames,
+	       (unsigned long long)audit.duplicates,
+	       (unsigned long long)audit.errors,
+	       (unsigned long long)audit.max_in_flight);
+	hist_print("inter-frame interval", "us", &audit.interval);
+	hist_print("submit to complete", "us", &audit.latency);
+	hist_print("burst length", "frames", &audit.burst);
+	if (step.cpu >= 0) {
+		hist_print("load to LED", "us", &audit.step);
+		printf("load to LED: %llu runs without the LED reaching %d in 5 s\n",
+		       (unsigned long long)audit.step_misses, step.level);
+	}
+
+	close(fd);
+
+	return 0;
+}
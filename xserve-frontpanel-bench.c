@@ -0,0 +1,357 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Hardware-free benchmark of the Xserve front-panel driver.
+ *
+ * Builds the driver itself against a fake USB backend that completes each
+ * URB right away or after bench_delay_us, and in place of registering the
+ * USB driver times:
+ *
+ *  - the sampler, renderer and submission of a tick, for each display mode,
+ *    frame buffer strategy, capacity_scale and anomaly_sigma on and off,
+ *    as ns/tick (sampling), ns/frame (rendering) and ns/submit (the rest of
+ *    the tick per frame, the backend's delay included);
+ *  - the mailbox and submit work under 1 to all CPUs posting frames as fast
+ *    as they can, with and without urgent frames, as frames/s reaching the
+ *    backend.
+ *
+ * Results go to the kernel log, then loading fails with -EAGAIN so the
+ * module is gone again: "insmod xserve-frontpanel-bench.ko; dmesg".
+ */
+
+#include <linux/module.h>
+#include <linux/usb.h>
+#include <linux/hrtimer.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+
+static int fp_bench_submit_urb(struct urb *urb, gfp_t mem_flags);
+static int fp_bench_run(struct usb_driver *driver);
+
+/* the driver's USB I/O goes to the fake backend, its registration runs us */
+#define usb_submit_urb(urb, mem_flags)	fp_bench_submit_urb(urb, mem_flags)
+#define usb_unlink_anchored_urbs(anchor)	do { } while (0)
+#undef usb_register
+#define usb_register(driver)		fp_bench_run(driver)
+#define usb_deregister(driver)		do { } while (0)
+
+/* never bound to a panel, and not in the driver's way when it is loaded */
+#undef MODULE_DEVICE_TABLE
+#define MODULE_DEVICE_TABLE(type, name)
+#undef EXPORT_SYMBOL_GPL
+#define EXPORT_SYMBOL_GPL(sym)
+#undef CONFIG_PERF_EVENTS
+#undef CONFIG_DEBUG_INFO_BTF_MODULES
+#define debugfs_create_dir(name, parent)	debugfs_create_dir(KBUILD_MODNAME, parent)
+#define proc_create_single(name, mode, parent, show)	fp_bench_no_proc(show)
+#define remove_proc_entry(name, parent)	do { } while (0)
+
+static inline struct proc_dir_entry *fp_bench_no_proc(int (*show)(struct seq_file *, void *))
+{
+	return NULL;
+}
+
+#include "xserve-frontpanel.c"
+
+static unsigned int bench_ticks = 1000;
+module_param(bench_ticks, uint, 0444);
+MODULE_PARM_DESC(bench_ticks, "Ticks timed per pipeline configuration");
+
+static unsigned int bench_ms = 200;
+module_param(bench_ms, uint, 0444);
+MODULE_PARM_DESC(bench_ms, "Milliseconds per producer run");
+
+static unsigned int bench_delay_us = 125;
+module_param(bench_delay_us, uint, 0444);
+MODULE_PARM_DESC(bench_delay_us, "Completion delay of the slow backend, in us (one microframe)");
+
+static unsigned int fp_bench_delay_ns;			/* 0 completes in submit */
+static atomic_t fp_bench_timers;			/* delayed completions pending */
+
+struct fp_bench_urb {
+	struct hrtimer		timer;
+	struct urb		*urb;
+};
+
+/* what the HCD does on giveback */
+static void fp_bench_giveback(struct urb *urb)
+{
+	usb_unanchor_urb(urb);
+	urb->status = 0;
+	urb->actual_length = urb->transfer_buffer_length;
+	urb->complete(urb);
+	usb_free_urb(urb);
+}
+
+static enum hrtimer_restart fp_bench_complete(struct hrtimer *timer)
+{
+	struct fp_bench_urb *b = container_of(timer, struct fp_bench_urb, timer);
+
+	fp_bench_giveback(b->urb);
+	kfree(b);
+	atomic_dec(&fp_bench_timers);
+	return HRTIMER_NORESTART;
+}
+
+static int fp_bench_submit_urb(struct urb *urb, gfp_t mem_flags)
+{
+	struct fp_bench_urb *b;
+
+	usb_get_urb(urb);
+	if (!fp_bench_delay_ns) {
+		fp_bench_giveback(urb);
+		return 0;
+	}
+
+	b = kmalloc(sizeof(*b), mem_flags);
+	if (!b) {
+		usb_put_urb(urb);
+		return -ENOMEM;
+	}
+	b->urb = urb;
+	/* completions run in softirq context, as with most HCDs */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&b->timer, fp_bench_complete, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+#else
+	hrtimer_init(&b->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+	b->timer.function = fp_bench_complete;
+#endif
+	atomic_inc(&fp_bench_timers);
+	hrtimer_start(&b->timer, ns_to_ktime(fp_bench_delay_ns), HRTIMER_MODE_REL_SOFT);
+	return 0;
+}
+
+/* a device set up the way probe does, on the fake backend */
+static struct usb_frontpanel *fp_bench_dev_alloc(enum frontpanel_buffers buffers)
+{
+	struct usb_frontpanel *dev;
+	int i;
+
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev)
+		return NULL;
+	dev->udev = kzalloc(sizeof(*dev->udev), GFP_KERNEL);
+	dev->interface = kzalloc(sizeof(*dev->interface), GFP_KERNEL);
+	if (buffers == FP_BUF_POOL)
+		dev->pool = kzalloc(WRITES_IN_FLIGHT * PANEL_DATA_SIZE, GFP_KERNEL);
+	if (!dev->udev || !dev->interface || (buffers == FP_BUF_POOL && !dev->pool)) {
+		kfree(dev->pool);
+		kfree(dev->interface);
+		kfree(dev->udev);
+		kfree(dev);
+		return NULL;
+	}
+	dev->interface->dev.init_name = KBUILD_MODNAME;
+	dev->buffers = buffers;
+
+	kref_init(&dev->kref);
+	dev->depth = 1;
+	mutex_init(&dev->io_mutex);
+	init_usb_anchor(&dev->submitted);
+	init_usb_anchor(&dev->urgent);
+	INIT_DELAYED_WORK(&dev->release_held, frontpanel_release_held);
+	INIT_WORK(&dev->submit, frontpanel_submit);
+	spin_lock_init(&dev->view_lock);
+	bitmap_set(dev->view, 0, min(PANEL_CHANNELS, PANEL_MAX_CPUS));
+	dev->view_node = NUMA_NO_NODE;
+	for (i = 0; i < WRITES_IN_FLIGHT; i++)
+		dev->slot[i].dev = dev;
+	rackmeter_init_cpu_sniffer(dev);
+
+	return dev;
+}
+
+/* until nothing is posted or in flight, the way suspend drains */
+static void fp_bench_dev_drain(struct usb_frontpanel *dev)
+{
+	do {
+		flush_work(&dev->submit);
+		usleep_range(100, 200);
+	} while (atomic_read(&dev->in_flight) || frontpanel_posted(dev));
+	flush_work(&dev->submit);
+}
+
+static void fp_bench_dev_free(struct usb_frontpanel *dev)
+{
+	fp_bench_dev_drain(dev);
+	frontpanel_set_mode(dev, FP_MODE_CPU);
+	kfree(dev->pool);
+	kfree(dev->interface);
+	kfree(dev->udev);
+	kfree(dev);
+}
+
+static u64 fp_bench_frames(void)
+{
+	struct frontpanel_stats sum;
+
+	frontpanel_stats_sum(&sum);
+	return sum.frames_submitted;
+}
+
+/* one configuration of the sampler to the backend, a tick at a time */
+static void fp_bench_pipeline(enum frontpanel_mode mode, enum frontpanel_buffers buffers,
+			      bool scale, unsigned int sigma)
+{
+	struct usb_frontpanel *dev = fp_bench_dev_alloc(buffers);
+	u64 sample_ns = 0, render_ns = 0, frames;
+	ktime_t t0, t1, t2;
+	unsigned int i;
+	bool alert;
+
+	if (!dev)
+		return;
+	if (frontpanel_set_mode(dev, mode)) {
+		pr_info("%s: %s mode not available\n", KBUILD_MODNAME,
+			frontpanel_mode_names[mode]);
+		fp_bench_dev_free(dev);
+		return;
+	}
+	WRITE_ONCE(capacity_scale, scale);
+	WRITE_ONCE(anomaly_sigma, sigma);
+
+	frames = fp_bench_frames();
+	t2 = ktime_get();
+	for (i = 0; i < bench_ticks; i++) {
+		t0 = ktime_get();
+		rackmeter_sample(dev);
+		t1 = ktime_get();
+		rackmeter_update_trend(dev);
+		alert = rackmeter_detect_anomalies(dev);
+		rackmeter_publish(dev, t0);
+		rackmeter_render_frame(dev, dev->buffer);
+		sample_ns += ktime_to_ns(ktime_sub(t1, t0));
+		render_ns += ktime_to_ns(ktime_sub(ktime_get(), t1));
+		/* every tick, changed or not, so each one reaches the backend */
+		frontpanel_post(dev, dev->buffer, NULL, t0, alert);
+		flush_work(&dev->submit);
+		cond_resched();
+	}
+	fp_bench_dev_drain(dev);
+	t2 = ktime_sub(ktime_get(), t2);
+	frames = fp_bench_frames() - frames;
+
+	pr_info("%s: %-7s %-9s scale %u sigma %u: %6llu ns/tick %6llu ns/frame %6llu ns/submit\n",
+		KBUILD_MODNAME, frontpanel_mode_names[mode], frontpanel_buffers_names[buffers],
+		scale, sigma, div_u64(sample_ns, bench_ticks), div_u64(render_ns, bench_ticks),
+		frames ? div64_u64(ktime_to_ns(t2) - sample_ns - render_ns, frames) : 0);
+	fp_bench_dev_free(dev);
+}
+
+struct fp_bench_producer {
+	struct usb_frontpanel	*dev;
+	struct task_struct	*task;
+	bool			urgent;
+	u64			posts;
+};
+
+/* posts frames with one LED changed each, every 64th urgent if asked */
+static int fp_bench_produce(void *data)
+{
+	struct fp_bench_producer *p = data;
+	__u8 frame[PANEL_DATA_SIZE] = { };
+	DECLARE_BITMAP(mask, PANEL_CHANNELS);
+	unsigned int ch;
+
+	while (!kthread_should_stop()) {
+		ch = p->posts % PANEL_CHANNELS;
+		frame[ch]++;
+		bitmap_zero(mask, PANEL_CHANNELS);
+		__set_bit(ch, mask);
+		frontpanel_post(p->dev, frame, mask, ktime_get(),
+				p->urgent && !(p->posts % 64));
+		p->posts++;
+		cond_resched();
+	}
+	return 0;
+}
+
+static void fp_bench_producers(unsigned int n, bool urgent)
+{
+	struct usb_frontpanel *dev = fp_bench_dev_alloc(FP_BUF_STREAMING);
+	struct fp_bench_producer *p;
+	unsigned int i = 0, cpu;
+	u64 frames, posts = 0;
+	ktime_t start;
+
+	p = kcalloc(n, sizeof(*p), GFP_KERNEL);
+	if (!dev || !p)
+		goto out;
+
+	for_each_online_cpu(cpu) {
+		if (i == n)
+			break;
+		p[i].dev = dev;
+		p[i].urgent = urgent;
+		p[i].task = kthread_create(fp_bench_produce, &p[i], "fp-bench/%u", cpu);
+		if (IS_ERR(p[i].task))
+			break;
+		kthread_bind(p[i].task, cpu);
+		i++;
+	}
+	n = i;
+
+	frames = fp_bench_frames();
+	start = ktime_get();
+	for (i = 0; i < n; i++)
+		wake_up_process(p[i].task);
+	msleep(bench_ms);
+	for (i = 0; i < n; i++) {
+		kthread_stop(p[i].task);
+		posts += p[i].posts;
+	}
+	start = ktime_sub(ktime_get(), start);
+	frames = fp_bench_frames() - frames;
+
+	pr_info("%s: %3u producers%s: %9llu posts/s %8llu frames/s\n", KBUILD_MODNAME,
+		n, urgent ? " urgent" : "       ",
+		div64_u64(posts * NSEC_PER_SEC, ktime_to_ns(start)),
+		div64_u64(frames * NSEC_PER_SEC, ktime_to_ns(start)));
+out:
+	kfree(p);
+	if (dev)
+		fp_bench_dev_free(dev);
+}
+
+static int fp_bench_run(struct usb_driver *driver)
+{
+	static const unsigned int delays_us[] = { 0, 1 };
+	static const enum frontpanel_buffers buffers[] = { FP_BUF_STREAMING, FP_BUF_POOL };
+	bool scale = READ_ONCE(capacity_scale);
+	unsigned int sigma = READ_ONCE(anomaly_sigma);
+	unsigned int d, b, mode, n;
+
+	if (!bench_ticks || !bench_ms)
+		return -EINVAL;
+
+	for (d = 0; d < ARRAY_SIZE(delays_us); d++) {
+		fp_bench_delay_ns = delays_us[d] * bench_delay_us * NSEC_PER_USEC;
+		pr_info("%s: %u CPUs, completions %s %u us\n", KBUILD_MODNAME,
+			num_online_cpus(), fp_bench_delay_ns ? "after" : "in submit",
+			fp_bench_delay_ns / NSEC_PER_USEC);
+
+		for (mode = 0; mode < FP_MODE_COUNT; mode++)
+			for (b = 0; b < ARRAY_SIZE(buffers); b++) {
+				fp_bench_pipeline(mode, buffers[b], false, 0);
+				fp_bench_pipeline(mode, buffers[b], true, 0);
+				fp_bench_pipeline(mode, buffers[b], false, 3);
+			}
+
+		for (n = 1; ; n = min(2 * n, num_online_cpus())) {
+			fp_bench_producers(n, false);
+			fp_bench_producers(n, true);
+			if (n == num_online_cpus())
+				break;
+		}
+	}
+
+	WRITE_ONCE(capacity_scale, scale);
+	WRITE_ONCE(anomaly_sigma, sigma);
+
+	/* the last callbacks are done with the module once out of softirq */
+	while (atomic_read(&fp_bench_timers))
+		usleep_range(100, 200);
+	synchronize_rcu();
+
+	/* done, unload again */
+	return -EAGAIN;
+}
@@ -23,14 +23,70 @@
 #include <linux/usb.h>
 #include <linux/mutex.h>
 #include <linux/cpufreq.h>
+#include <linux/sched/cpufreq.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/moduleparam.h>
+#include <linux/kfifo.h>
+#include <linux/sched/clock.h>
+#include <linux/tracepoint.h>
+#include <trace/events/lock.h>
+#include <linux/fault-inject.h>
+#include <linux/perf_event.h>
+#include <linux/topology.h>
+#include <linux/proc_fs.h>
+#include <linux/cpuhotplug.h>
+#include <linux/sched/topology.h>
+#include <linux/vmalloc.h>
+#include <linux/seqlock.h>
+#include <linux/btf.h>
+#include <linux/btf_ids.h>
+#include <linux/netdevice.h>
+#include <linux/version.h>
+
+#include "xserve-frontpanel.h"
 
 #define PANEL_VENDOR 0x5ac
 #define PANEL_PRODUCT 0x8261
 #define PANEL_CONFIG 0
 #define PANEL_DATA_SIZE 32
 
+/*
+ * Build-time configuration. Each of these can be overridden with the Kbuild
+ * variable of the same name, e.g. "make PANEL_MAX_CPUS=256".
+ */
+
+/* number of meter LEDs, two rows of eight */
+#ifndef PANEL_CHANNELS
+#define PANEL_CHANNELS		16
+#endif
+
+/* highest number of CPUs sampled, extra CPUs share a LED */
+#ifndef PANEL_MAX_CPUS
+#define PANEL_MAX_CPUS		PANEL_CHANNELS
+#endif
+
 /* CPU meter sampling rate in ms */
+#ifndef CPU_SAMPLING_RATE
 #define CPU_SAMPLING_RATE	250
+#endif
+
+/*
+ * MAX_TRANSFER is chosen so that the VM is not stressed by
+ * allocations > PAGE_SIZE and the number of packets in a page
+ * is an integer 512 is the largest possible packet on EHCI
+ */
+#ifndef WRITES_IN_FLIGHT
+#define WRITES_IN_FLIGHT	8
+#endif
+/* arbitrarily chosen */
+
+static_assert(PANEL_CHANNELS <= PANEL_DATA_SIZE);
+static_assert(WRITES_IN_FLIGHT >= 1 && WRITES_IN_FLIGHT <= BITS_PER_LONG);
+static_assert(CPU_SAMPLING_RATE > 0);
 
 
 /* table of devices that work with this driver */
@@ -40,19 +96,461 @@ static const struct usb_device_id frontpanel_table[] = {
 };
 MODULE_DEVICE_TABLE(usb, frontpanel_table);
 
+/*
+ * sample-to-panel latency histogram, log2 buckets of microseconds: bucket i
+ * holds latencies in (2^(i-1), 2^i] us, bucket 0 up to 1 us
+ */
+#define LATENCY_BUCKETS		16
+
+
+/* driver-wide counters, kept per CPU so every path can bump them locklessly */
+struct frontpanel_stats {
+	u64			ticks;			/* sampler runs */
+	u64			periods;		/* ticks following another tick */
+	u64			period_ns;		/* time between those ticks */
+	u64			sample_ns;		/* time spent sampling the CPUs */
+	u64			skew_ns;		/* first to last CPU read within a tick */
+	u64			skew_max_ns;
+	u64			frames_rendered;
+	u64			frames_suppressed;	/* identical to the last frame, not sent */
+	u64			frames_submitted;
+	u64			submit_ns;		/* time spent in frontpanel_write() */
+	u64			completions;		/* write completions handled */
+	u64			complete_ns;		/* time spent in those, freeing included */
+	u64			frames_dropped;		/* frontpanel_write() failed */
+	u64			urb_errors;		/* completed with a nonzero status */
+	u64			alerts;			/* CPUs flagged as anomalous */
+	u64			depth_increases;
+	u64			depth_decreases;
+	u64			frames_unlinked;	/* meter frames dropped for an urgent one */
+	u64			urgent_frames;		/* urgent frames acknowledged */
+	u64			urgent_us;		/* sampled to acknowledged, urgent frames */
+	u64			latency[LATENCY_BUCKETS];
+	u64			latency_ns;		/* sum of the histogram's latencies */
+};
+
+static struct frontpanel_stats __percpu *fp_stats;
+static struct dentry *fp_debugfs;
 
 /*
- * MAX_TRANSFER is chosen so that the VM is not stressed by
- * allocations > PAGE_SIZE and the number of packets in a page
- * is an integer 512 is the largest possible packet on EHCI
+ * The sampler runs from a WQ_HIGHPRI workqueue so the meter keeps its pace
+ * on a loaded (or PREEMPT_RT) system, and gives the CPU up every
+ * sample_chunk CPUs so a big sweep never holds it for long.
  */
-#define WRITES_IN_FLIGHT	8
-/* arbitrarily chosen */
+static struct workqueue_struct *fp_wq;
+
+static unsigned int sample_chunk = 32;
+module_param(sample_chunk, uint, 0644);
+MODULE_PARM_DESC(sample_chunk, "CPUs sampled between rescheduling points (0 = whole sweep)");
+
+/*
+ * Where frame buffers come from. With an IOMMU in strict mode allocating
+ * and mapping every 32 byte frame is the expensive part of a write, the
+ * pool maps one coherent block at probe and slices it per write slot.
+ */
+enum frontpanel_buffers {
+	FP_BUF_AUTO,
+	FP_BUF_COHERENT,	/* usb_alloc_coherent() per frame */
+	FP_BUF_STREAMING,	/* kmalloc() per frame, mapped by the HCD */
+	FP_BUF_POOL,		/* one coherent block sliced per slot */
+	FP_BUF_COUNT
+};
+
+static const char * const frontpanel_buffers_names[FP_BUF_COUNT] = {
+	[FP_BUF_AUTO]		= "auto",
+	[FP_BUF_COHERENT]	= "coherent",
+	[FP_BUF_STREAMING]	= "streaming",
+	[FP_BUF_POOL]		= "pool",
+};
+
+static int fp_buffers = FP_BUF_AUTO;
+
+static int frontpanel_buffers_set(const char *val, const struct kernel_param *kp)
+{
+	int i = sysfs_match_string(frontpanel_buffers_names, val);
+
+	if (i < 0)
+		return i;
+	*(int *)kp->arg = i;
+
+	return 0;
+}
+
+static int frontpanel_buffers_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%s\n", frontpanel_buffers_names[*(int *)kp->arg]);
+}
+
+static const struct kernel_param_ops frontpanel_buffers_ops = {
+	.set = frontpanel_buffers_set,
+	.get = frontpanel_buffers_get,
+};
+module_param_cb(buffers, &frontpanel_buffers_ops, &fp_buffers, 0644);
+MODULE_PARM_DESC(buffers, "Frame buffer strategy for newly probed panels: auto, coherent, streaming or pool");
+
+/*
+ * Fault injection for the submit and completion paths, configured through
+ * the usual fault_attr files (probability, interval, times, ...) under
+ * debugfs xserve-frontpanel/.
+ */
+#ifdef CONFIG_FAULT_INJECTION
+static DECLARE_FAULT_ATTR(fp_fail_urb_alloc);
+static DECLARE_FAULT_ATTR(fp_fail_submit);
+static DECLARE_FAULT_ATTR(fp_fail_completion);	/* complete with fail_completion_errno */
+static DECLARE_FAULT_ATTR(fp_delay_completion);	/* hold the write slot for delay_completion_ms */
+#define frontpanel_should_fail(attr)	should_fail(&(attr), 1)
+#else
+#define frontpanel_should_fail(attr)	false
+#endif
+static u32 fp_fail_completion_errno = EPROTO;
+static u32 fp_delay_completion_ms = 100;
+
+/*
+ * Optional per-tick, per-CPU log of the sampler's view, so its accuracy
+ * can be checked against /proc/stat from userspace (tools/fp-loadcheck).
+ * Written by the sampler only, read through debugfs loadlog. Only CPU
+ * loads are logged, with the backend that measured them.
+ */
+struct rackmeter_logrec {
+	u64			wall_us;		/* end of the window, CLOCK_MONOTONIC */
+	u32			window_us;
+	u32			busy_us;
+	u16			cpu;
+	u8			load;			/* what the LED was given */
+	bool			hook;			/* from the sched hook, else polled */
+};
+
+static bool fp_loadlog_enable;
+static DEFINE_MUTEX(fp_loadlog_lock);
+static DEFINE_KFIFO(fp_loadlog, struct rackmeter_logrec, 4096);
+
+static void rackmeter_log_load(unsigned int cpu, __u8 load, u64 wall, s64 diff_wall,
+			       s64 diff_idle, bool hook)
+{
+	struct rackmeter_logrec rec = {
+		.wall_us = wall,
+		.window_us = diff_wall,
+		.busy_us = diff_wall - min(diff_idle, diff_wall),
+		.cpu = cpu,
+		.load = load,
+		.hook = hook,
+	};
+
+	if (!READ_ONCE(fp_loadlog_enable))
+		return;
+	/* a full log drops the record, the reader lags */
+	kfifo_put(&fp_loadlog, rec);
+}
+
+/*
+ * The last frame sent, readable as the "frame" parameter. Handing it back
+ * with frame=<hex> on the next load shows it again right at probe, so a
+ * reload does not blank the panel while the sampler waits for its first
+ * interval.
+ */
+static __u8 fp_stash[PANEL_CHANNELS];
+static bool fp_stash_valid;
+
+static int frontpanel_stash_set(const char *val, const struct kernel_param *kp)
+{
+	size_t len = strcspn(val, "\n");
+	__u8 frame[PANEL_CHANNELS];
+
+	/* a bad digit halfway must not leave the stash half overwritten */
+	if (len != 2 * PANEL_CHANNELS || hex2bin(frame, val, PANEL_CHANNELS))
+		return -EINVAL;
+	memcpy(fp_stash, frame, PANEL_CHANNELS);
+	fp_stash_valid = true;
+
+	return 0;
+}
+
+static int frontpanel_stash_get(char *buffer, const struct kernel_param *kp)
+{
+	return sprintf(buffer, "%*phN\n", PANEL_CHANNELS, fp_stash);
+}
+
+static const struct kernel_param_ops frontpanel_stash_ops = {
+	.set = frontpanel_stash_set,
+	.get = frontpanel_stash_get,
+};
+module_param_cb(frame, &frontpanel_stash_ops, NULL, 0644);
+MODULE_PARM_DESC(frame, "Last frame sent, as hex; pass it back at load to restore the panel");
+
+/*
+ * What the panel showed over the last day, in a ring of fixed-size chunks
+ * allocated at load, so the sampler never allocates. To fit a day of a
+ * busy machine, where every LED changes all the time, the frames are
+ * averaged over HISTORY_TICKS ticks (a second) and each LED is kept at 16
+ * levels, a nibble. Each chunk starts with a header and a keyframe, a byte
+ * per LED, followed by one record per period after it:
+ *
+ *   0x00-0x7f	the previous frame again, 1 to 128 times
+ *   0x80	a delta: a bitmap of the changed LEDs, then a signed nibble
+ *		per changed LED, two to a byte, low one first
+ *   0x81	a full frame, two LEDs to a byte, low one first
+ *
+ * so even a frame that changed entirely takes 1 + PANEL_CHANNELS / 2 bytes
+ * a second, and the ring holds more than a day. A gap in the ticks
+ * (suspend, reset) starts a new chunk. Read as a whole through debugfs
+ * history, tools/fp-history-decode turns it back into frames.
+ */
+#define HISTORY_CHUNK_SIZE	4096
+#define HISTORY_CHUNKS		240			/* 960 KiB */
+#define HISTORY_VERSION		2
+#define HISTORY_TICKS		DIV_ROUND_UP(1000, CPU_SAMPLING_RATE)
+#define HISTORY_LEVEL		17			/* brightness per nibble step */
+#define HISTORY_RUN_MAX		0x7f
+#define HISTORY_DELTA		0x80
+#define HISTORY_FULL		0x81
+#define HISTORY_MASK_SIZE	DIV_ROUND_UP(PANEL_CHANNELS, 8)
+#define HISTORY_FULL_SIZE	(1 + DIV_ROUND_UP(PANEL_CHANNELS, 2))
+static_assert(PANEL_CHANNELS <= U8_MAX);
+static_assert(HISTORY_TICKS * CPU_SAMPLING_RATE <= U16_MAX);
+
+struct frontpanel_history_chunk {
+	__le64			start_ns;		/* keyframe, CLOCK_REALTIME */
+	__le32			seq;			/* writing order from 1, 0 if unused */
+	__le16			used;			/* bytes of records */
+	__le16			period_ms;
+	__le16			size;			/* of the chunk, this header included */
+	__u8			channels;
+	__u8			version;
+	__u8			data[];			/* keyframe, then records */
+} __packed;
+
+#define HISTORY_ROOM		(HISTORY_CHUNK_SIZE - sizeof(struct frontpanel_history_chunk) - \
+				 PANEL_CHANNELS)
+
+static bool history = true;
+module_param(history, bool, 0444);
+MODULE_PARM_DESC(history, "Keep a compressed history of the frames shown");
+
+static struct {
+	void			*buf;			/* HISTORY_CHUNKS chunks */
+	struct frontpanel_history_chunk *chunk;		/* being appended to */
+	unsigned int		used;
+	u32			seq;
+	__u8			*run;			/* record counting repeats, if last */
+	__u8			last[PANEL_CHANNELS];	/* nibbles */
+	ktime_t			last_tick;
+	u32			sum[PANEL_CHANNELS];	/* of the period's ticks so far */
+	unsigned int		ticks;
+	bool			gap;			/* start a new chunk */
+} fp_history;
+static DEFINE_MUTEX(fp_history_lock);
+
+static void frontpanel_history_start(const __u8 *frame)
+{
+	unsigned int i = fp_history.chunk ?
+		((void *)fp_history.chunk - fp_history.buf) / HISTORY_CHUNK_SIZE + 1 : 0;
+	struct frontpanel_history_chunk *c = fp_history.buf + i % HISTORY_CHUNKS * HISTORY_CHUNK_SIZE;
+
+	c->start_ns = cpu_to_le64(ktime_get_real_ns());
+	c->seq = cpu_to_le32(++fp_history.seq);
+	c->used = 0;
+	c->period_ms = cpu_to_le16(HISTORY_TICKS * CPU_SAMPLING_RATE);
+	c->size = cpu_to_le16(HISTORY_CHUNK_SIZE);
+	c->channels = PANEL_CHANNELS;
+	c->version = HISTORY_VERSION;
+	memcpy(c->data, frame, PANEL_CHANNELS);
+
+	fp_history.chunk = c;
+	fp_history.used = 0;
+	fp_history.run = NULL;
+	fp_history.gap = false;
+}
+
+/* the n-th nibble of a packed run of them */
+static void frontpanel_history_nibble(__u8 *p, unsigned int n, unsigned int v)
+{
+	if (n % 2)
+		p[n / 2] |= (v & 0xf) << 4;
+	else
+		p[n / 2] = v & 0xf;
+}
+
+/* one period's frame, as nibbles */
+static void frontpanel_history_record(const __u8 *frame)
+{
+	__u8 *rec, *mask, *delta;
+	unsigned int ch, changed = 0;
+	int d;
+
+	if (!fp_history.chunk || fp_history.gap ||
+	    fp_history.used + HISTORY_FULL_SIZE > HISTORY_ROOM) {
+		frontpanel_history_start(frame);
+		return;
+	}
+
+	rec = fp_history.chunk->data + PANEL_CHANNELS + fp_history.used;
+
+	if (!memcmp(frame, fp_history.last, PANEL_CHANNELS)) {
+		if (fp_history.run && *fp_history.run < HISTORY_RUN_MAX) {
+			(*fp_history.run)++;
+			return;
+		}
+		*rec = 0;
+		fp_history.run = rec;
+		fp_history.used++;
+		return;
+	}
+	fp_history.run = NULL;
+
+	/* a delta unless some LED moved too far or it is no shorter */
+	mask = rec + 1;
+	delta = mask + HISTORY_MASK_SIZE;
+	memset(mask, 0, HISTORY_MASK_SIZE);
+	for (ch = 0; ch < PANEL_CHANNELS; ch++) {
+		d = frame[ch] - fp_history.last[ch];
+		if (!d)
+			continue;
+		if (d < -8 || d > 7 ||
+		    1 + HISTORY_MASK_SIZE + (changed + 2) / 2 >= HISTORY_FULL_SIZE)
+			break;
+		mask[ch / 8] |= BIT(ch % 8);
+		frontpanel_history_nibble(delta, changed++, d);
+	}
+
+	if (ch == PANEL_CHANNELS) {
+		*rec = HISTORY_DELTA;
+		fp_history.used += 1 + HISTORY_MASK_SIZE + DIV_ROUND_UP(changed, 2);
+	} else {
+		*rec = HISTORY_FULL;
+		for (ch = 0; ch < PANEL_CHANNELS; ch++)
+			frontpanel_history_nibble(rec + 1, ch, frame[ch]);
+		fp_history.used += HISTORY_FULL_SIZE;
+	}
+}
+
+static void frontpanel_history_add(const __u8 *frame, ktime_t now)
+{
+	__u8 levels[PANEL_CHANNELS];
+	unsigned int ch;
+
+	if (!fp_history.buf)
+		return;
+
+	mutex_lock(&fp_history_lock);
+
+	/* a period cut short isn't recorded */
+	if (ktime_ms_delta(now, fp_history.last_tick) > 2 * CPU_SAMPLING_RATE) {
+		memset(fp_history.sum, 0, sizeof(fp_history.sum));
+		fp_history.ticks = 0;
+		fp_history.gap = true;
+	}
+	fp_history.last_tick = now;
+
+	for (ch = 0; ch < PANEL_CHANNELS; ch++)
+		fp_history.sum[ch] += frame[ch];
+	if (++fp_history.ticks < HISTORY_TICKS)
+		goto out;
+
+	for (ch = 0; ch < PANEL_CHANNELS; ch++)
+		levels[ch] = DIV_ROUND_CLOSEST(fp_history.sum[ch],
+					       HISTORY_TICKS * HISTORY_LEVEL);
+	frontpanel_history_record(levels);
+	fp_history.chunk->used = cpu_to_le16(fp_history.used);
+	memcpy(fp_history.last, levels, PANEL_CHANNELS);
+	memset(fp_history.sum, 0, sizeof(fp_history.sum));
+	fp_history.ticks = 0;
+
+out:
+	mutex_unlock(&fp_history_lock);
+}
 
+struct usb_frontpanel;
+
+/* the posted_mask bits: one per LED, then whether an urgent frame is among them */
+#define FP_POST_URGENT		PANEL_CHANNELS
+#define FP_POST_LONGS		BITS_TO_LONGS(PANEL_CHANNELS + 1)
+
+/* per-URB bookkeeping, one slot for each write in flight */
+struct frontpanel_slot {
+	struct usb_frontpanel	*dev;
+	ktime_t			sampled;		/* when the frame contents were sampled */
+	ktime_t			submitted;
+	bool			urgent;
+};
+
+/*
+ * A frame raising an alert shouldn't wait behind meter frames the panel is
+ * slow to take, they are stale by the time it gets to them anyway.
+ */
+static bool priority_lane = true;
+module_param(priority_lane, bool, 0644);
+MODULE_PARM_DESC(priority_lane, "Unlink queued meter frames to send alert frames first");
+
+
+/*
+ * "trend" mode shows the mean load as PANEL_CHANNELS / TREND_ROWS LED bars,
+ * instantaneous and smoothed over 1 s, 10 s and 60 s. The averages are
+ * exponential, alpha = T / (tau + T) for sampling period T, kept in fixed
+ * point so a tick costs a multiply per row and no history.
+ */
+#define TREND_ROWS		4
+#define TREND_SHIFT		16
+#define TREND_ALPHA(tau_ms)	((u32)((1ULL << TREND_SHIFT) * CPU_SAMPLING_RATE / \
+				       ((tau_ms) + CPU_SAMPLING_RATE)))
+static_assert(PANEL_CHANNELS >= TREND_ROWS);
+
+static const u32 fp_trend_alpha[TREND_ROWS] = {
+	1 << TREND_SHIFT,	/* instantaneous */
+	TREND_ALPHA(1000),
+	TREND_ALPHA(10000),
+	TREND_ALPHA(60000),
+};
+
+/* what the LEDs show, selected through the "mode" sysfs attribute */
+enum frontpanel_mode {
+	FP_MODE_CPU,		/* CPU busy time */
+	FP_MODE_LOCKS,		/* time spent spinning on contended locks */
+	FP_MODE_TREND,		/* mean load as bars at several time constants */
+	FP_MODE_VIEW,		/* CPU busy time of a window of CPUs, one per LED */
+	FP_MODE_SOFTNET,	/* packet receive saturation */
+	FP_MODE_COUNT
+};
+
+static const char * const frontpanel_mode_names[FP_MODE_COUNT] = {
+	[FP_MODE_CPU]	= "cpu",
+	[FP_MODE_LOCKS]	= "locks",
+	[FP_MODE_TREND]	= "trend",
+	[FP_MODE_VIEW]	= "view",
+	[FP_MODE_SOFTNET] = "softnet",
+};
+
+/*
+ * Anomaly alerts: each CPU keeps a streaming mean and variance of its load,
+ * Welford's update with the count capped at ANOMALY_WINDOW ticks so the
+ * baseline follows slow changes. A CPU more than anomaly_sigma standard
+ * deviations off its own baseline, or a package whose mean load is
+ * ANOMALY_PACKAGE_GAP away from the other packages, blinks its LED for
+ * ANOMALY_HOLD ticks.
+ */
+#define ANOMALY_WINDOW		256
+#define ANOMALY_WARMUP		32
+#define ANOMALY_HOLD		8
+#define ANOMALY_MIN_SIGMA	8	/* in load units, keeps idle CPUs from tripping on noise */
+#define ANOMALY_PACKAGE_GAP	64
+#define ANOMALY_MAX_PACKAGES	8
+
+static unsigned int anomaly_sigma = 3;
+module_param(anomaly_sigma, uint, 0644);
+MODULE_PARM_DESC(anomaly_sigma, "Blink CPUs whose load is this many standard deviations off their baseline (0 = off)");
 
 struct rackmeter_cpu {
 	u64			prev_wall;
 	u64			prev_idle;
+	u64			prev_lock_ns;
+	u32			prev_processed;		/* softnet_data counters */
+	u32			prev_squeezed;
+	u32			prev_dropped;
+	__u8			load;
+
+	s32			mean;			/* load, 8.8 fixed point */
+	s64			var;			/* load^2, 16.16 fixed point */
+	u16			samples;		/* capped at ANOMALY_WINDOW */
+	u8			alert;			/* ticks left to blink */
 };
 
 
@@ -60,19 +558,50 @@ struct rackmeter_cpu {
 struct usb_frontpanel {
 	struct usb_device	*udev;			/* the usb device for this device */
 	struct usb_interface	*interface;		/* the interface for this device */
-	struct semaphore	limit_sem;		/* limiting the number of writes in progress */
+	atomic_t		in_flight;		/* writes submitted and not completed */
+	unsigned int		depth;			/* writes allowed in flight, tuned */
+	unsigned int		depth_credit;		/* good completions towards depth + 1 */
 	struct usb_anchor	submitted;		/* in case we need to retract our submissions */
-	int			errors;			/* the last request tanked */
-	spinlock_t		err_lock;		/* lock for errors */
+	struct usb_anchor	urgent;			/* urgent frames, never unlinked for others */
+	atomic_t		errors;			/* the last request tanked, lockless for RT */
 	struct kref		kref;
 	struct mutex		io_mutex;		/* synchronize I/O with disconnect */
 	__u8			bulk_out_endpointAddr;	/* the address of the bulk out endpoint */
 	unsigned long		disconnected:1;
+	unsigned long		hooked:1;		/* holds the update_util hooks */
 
 	struct delayed_work	sniffer;
-	
+	struct work_struct	submit;			/* the only caller of frontpanel_write() */
+	__u8			posted[PANEL_CHANNELS];	/* latest value of each LED posted */
+	s64			posted_ns[PANEL_CHANNELS];	/* when it was sampled */
+	atomic_long_t		posted_mask[FP_POST_LONGS];	/* not yet submitted */
+	bool			quiesced;		/* no submissions, sniffer stopped */
+	__u8			submit_frame[PANEL_DATA_SIZE];
+	ktime_t			last_tick;		/* 0 after (re)starting the sniffer */
+	enum frontpanel_mode	mode;
+	u32			trend[TREND_ROWS];	/* mean load EMAs, TREND_SHIFT fixed point */
+	spinlock_t		view_lock;		/* view, view_node, view_since */
+	DECLARE_BITMAP(view, PANEL_MAX_CPUS);		/* up to PANEL_CHANNELS CPUs */
+	int			view_node;		/* NUMA_NO_NODE for a list of CPUs */
+	unsigned long		view_since;		/* jiffies, when the view was set */
+	DECLARE_BITMAP(view_tick, PANEL_MAX_CPUS);	/* the sampler's copy of view */
+	bool			blink;			/* alert phase */
+
+	enum frontpanel_buffers	buffers;		/* never FP_BUF_AUTO */
+	__u8			*pool;			/* FP_BUF_POOL, a slice per slot */
+	dma_addr_t		pool_dma;
+
+	atomic_t		held_writes;		/* completions delayed by fault injection */
+	struct delayed_work	release_held;
+
+	unsigned long		slots_busy;		/* bitmap of slot[] in use */
+	struct frontpanel_slot	slot[WRITES_IN_FLIGHT];
+
+#if PANEL_MAX_CPUS > PANEL_CHANNELS
+	unsigned int		cpus_per_channel;	/* CPUs folded into one LED */
+#endif
 	__u8			buffer[PANEL_DATA_SIZE];
-	struct rackmeter_cpu	cpu[16];
+	struct rackmeter_cpu	cpu[PANEL_MAX_CPUS];
 };
 #define to_fp_dev(d) container_of(d, struct usb_frontpanel, kref)
 
@@ -82,201 +611,1609 @@ static void frontpanel_delete(struct kref *kref)
 {
 	struct usb_frontpanel *dev = to_fp_dev(kref);
 
+	if (dev->pool)
+		usb_free_coherent(dev->udev, WRITES_IN_FLIGHT * PANEL_DATA_SIZE,
+				  dev->pool, dev->pool_dma);
 	usb_put_intf(dev->interface);
 	usb_put_dev(dev->udev);
 	kfree(dev);
 }
 
-static void frontpanel_write_bulk_callback(struct urb *urb)
+static void frontpanel_account_latency(ktime_t sampled)
 {
-	struct usb_frontpanel *dev;
-	unsigned long flags;
+	s64 ns = max_t(s64, ktime_to_ns(ktime_sub(ktime_get(), sampled)), 0);
+	unsigned int bucket = order_base_2(DIV_ROUND_UP_ULL(ns, NSEC_PER_USEC));
+
+	this_cpu_inc(fp_stats->latency[min_t(unsigned int, bucket, LATENCY_BUCKETS - 1)]);
+	this_cpu_add(fp_stats->latency_ns, ns);
+}
+
+static struct frontpanel_slot *frontpanel_get_slot(struct usb_frontpanel *dev)
+{
+	unsigned int i;
+
+	/* in_flight <= depth <= WRITES_IN_FLIGHT guarantees there is a free slot */
+	do {
+		i = find_first_zero_bit(&dev->slots_busy, WRITES_IN_FLIGHT);
+	} while (i >= WRITES_IN_FLIGHT || test_and_set_bit(i, &dev->slots_busy));
+
+	return &dev->slot[i];
+}
+
+static void frontpanel_put_slot(struct frontpanel_slot *slot)
+{
+	struct usb_frontpanel *dev = slot->dev;
+
+	clear_bit(slot - dev->slot, &dev->slots_busy);
+}
 
-	dev = urb->context;
+/*
+ * Frames reach the panel through a mailbox rather than a queue: producers
+ * store the LEDs they change and publish them in posted_mask, and the
+ * submit work takes whatever is pending, so a burst of posts merges into a
+ * single frame. Posting neither sleeps nor spins and is safe from any
+ * context. The urgent flag is a bit of the mask, in its last word, so it is
+ * published and taken together with the LEDs of its frame.
+ */
+static bool frontpanel_posted(struct usb_frontpanel *dev)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(dev->posted_mask); i++)
+		if (atomic_long_read(&dev->posted_mask[i]))
+			return true;
+	return false;
+}
+
+/*
+ * A write completed, send what was posted meanwhile, unless suspending.
+ * The barrier orders the caller's in_flight update before reading the
+ * mask, pairing with the one in frontpanel_submit() after a re-post.
+ */
+static void frontpanel_kick(struct usb_frontpanel *dev)
+{
+	smp_mb__after_atomic();
+	if (!READ_ONCE(dev->quiesced) && frontpanel_posted(dev))
+		queue_work(fp_wq, &dev->submit);
+}
+
+/* the last word, holding FP_POST_URGENT, goes last */
+static void frontpanel_post_bits(struct usb_frontpanel *dev, const unsigned long *bits)
+{
+	unsigned int i;
+
+	for (i = 0; i < FP_POST_LONGS; i++) {
+		if (!bits[i])
+			continue;
+		/* the values, and the words before, ahead of these bits */
+		smp_mb__before_atomic();
+		atomic_long_or(bits[i], &dev->posted_mask[i]);
+	}
+}
+
+/* mask NULL posts the whole frame */
+static void frontpanel_post(struct usb_frontpanel *dev, const __u8 *frame,
+			    const unsigned long *mask, ktime_t sampled, bool urgent)
+{
+	unsigned long bits[FP_POST_LONGS];
+	unsigned int ch;
+
+	bitmap_zero(bits, PANEL_CHANNELS + 1);
+	if (mask)
+		bitmap_copy(bits, mask, PANEL_CHANNELS);
+	else
+		bitmap_set(bits, 0, PANEL_CHANNELS);
+	if (urgent)
+		__set_bit(FP_POST_URGENT, bits);
+
+	for_each_set_bit(ch, bits, PANEL_CHANNELS) {
+		WRITE_ONCE(dev->posted[ch], frame[ch]);
+		WRITE_ONCE(dev->posted_ns[ch], ktime_to_ns(sampled));
+	}
+	frontpanel_post_bits(dev, bits);
+	if (!READ_ONCE(dev->quiesced))
+		queue_work(fp_wq, &dev->submit);
+}
+
+static void frontpanel_release_held(struct work_struct *work)
+{
+	struct usb_frontpanel *dev = container_of(work, struct usb_frontpanel,
+						  release_held.work);
+	int held = atomic_xchg(&dev->held_writes, 0);
+
+	atomic_sub(held, &dev->in_flight);
+	frontpanel_kick(dev);
+}
+
+static void *frontpanel_alloc_buffer(struct usb_frontpanel *dev,
+				     struct frontpanel_slot *slot,
+				     struct urb *urb, size_t size)
+{
+	unsigned int i = slot - dev->slot;
+
+	switch (dev->buffers) {
+	case FP_BUF_POOL:
+		urb->transfer_dma = dev->pool_dma + i * PANEL_DATA_SIZE;
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		return dev->pool + i * PANEL_DATA_SIZE;
+	case FP_BUF_STREAMING:
+		return kmalloc(size, GFP_KERNEL);
+	default:
+		urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+		return usb_alloc_coherent(dev->udev, size, GFP_KERNEL,
+					  &urb->transfer_dma);
+	}
+}
+
+static void frontpanel_free_buffer(struct usb_frontpanel *dev,
+				   struct urb *urb, void *buf, size_t size)
+{
+	switch (dev->buffers) {
+	case FP_BUF_POOL:
+		break;
+	case FP_BUF_STREAMING:
+		kfree(buf);
+		break;
+	default:
+		usb_free_coherent(dev->udev, size, buf, urb->transfer_dma);
+		break;
+	}
+}
 
-	/* sync/async unlink faults aren't errors */
-	if (urb->status) {
-		if (!(urb->status == -ENOENT ||
-		    urb->status == -ECONNRESET ||
-		    urb->status == -ESHUTDOWN))
+/*
+ * Queue depth control, the way TCP treats its congestion window: while
+ * frames complete within target_latency_us the allowed depth grows by one
+ * per depth's worth of good completions, a slow or failed completion halves
+ * it. A healthy bus keeps the queue short and fresh enough, a stalling hub
+ * stops frames from piling up behind it.
+ */
+static unsigned int target_latency_us = CPU_SAMPLING_RATE * USEC_PER_MSEC / 4;
+module_param(target_latency_us, uint, 0644);
+MODULE_PARM_DESC(target_latency_us, "Submit-to-completion latency above which the write queue shrinks");
+
+static void frontpanel_tune_depth(struct usb_frontpanel *dev, int status, s64 latency_us)
+{
+	unsigned int depth = dev->depth;
+
+	/* unlinks are our own doing, not the bus */
+	if (status == -ENOENT || status == -ECONNRESET || status == -ESHUTDOWN)
+		return;
+
+	if (status || latency_us > READ_ONCE(target_latency_us)) {
+		dev->depth_credit = 0;
+		if (depth > 1) {
+			WRITE_ONCE(dev->depth, depth / 2);
+			this_cpu_inc(fp_stats->depth_decreases);
+		}
+		return;
+	}
+
+	if (depth < WRITES_IN_FLIGHT && ++dev->depth_credit >= depth) {
+		dev->depth_credit = 0;
+		WRITE_ONCE(dev->depth, depth + 1);
+		this_cpu_inc(fp_stats->depth_increases);
+	}
+}
+
+static void frontpanel_write_bulk_callback(struct urb *urb)
+{
+	struct frontpanel_slot *slot = urb->context;
+	struct usb_frontpanel *dev = slot->dev;
+	int status = urb->status;
+	bool delayed = frontpanel_should_fail(fp_delay_completion);
+	ktime_t start = ktime_get();
+	s64 latency_us = ktime_us_delta(start, slot->submitted);
+
+	if (!status && frontpanel_should_fail(fp_fail_completion))
+		status = -(int)READ_ONCE(fp_fail_completion_errno);
+
+	/* superseded by an urgent frame, the panel never missed it */
+	if (status == -ECONNRESET && !slot->urgent) {
+		this_cpu_inc(fp_stats->frames_unlinked);
+	} else if (status) {
+		/* sync/async unlink faults aren't errors */
+		if (!(status == -ENOENT ||
+		    status == -ECONNRESET ||
+		    status == -ESHUTDOWN))
 			dev_err(&dev->interface->dev,
 				"%s - nonzero write bulk status received: %d\n",
-				__func__, urb->status);
+				__func__, status);
+
+		this_cpu_inc(fp_stats->urb_errors);
+		atomic_set(&dev->errors, status);
+	} else {
+		frontpanel_account_latency(slot->sampled);
+		if (slot->urgent) {
+			this_cpu_inc(fp_stats->urgent_frames);
+			this_cpu_add(fp_stats->urgent_us,
+				     ktime_us_delta(ktime_get(), slot->sampled));
+		}
+	}
+
+	/* free up our allocated buffer */
+	frontpanel_free_buffer(dev, urb, urb->transfer_buffer,
+			       urb->transfer_buffer_length);
+	frontpanel_put_slot(slot);
+	this_cpu_inc(fp_stats->completions);
+	this_cpu_add(fp_stats->complete_ns, ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	/* pretend a slow completion by keeping the write accounted in flight */
+	if (delayed) {
+		latency_us += READ_ONCE(fp_delay_completion_ms) * USEC_PER_MSEC;
+		frontpanel_tune_depth(dev, status, latency_us);
+		atomic_inc(&dev->held_writes);
+		schedule_delayed_work(&dev->release_held,
+				      msecs_to_jiffies(READ_ONCE(fp_delay_completion_ms)));
+		return;
+	}
+	frontpanel_tune_depth(dev, status, latency_us);
+	atomic_dec(&dev->in_flight);
+	frontpanel_kick(dev);
+}
+
+/*
+ * Urgent frames go ahead of the queued meter frames: those are unlinked, and
+ * the urgent frame may use every slot regardless of the tuned depth since
+ * the unlinks only free theirs once the host controller gave them back.
+ */
+static ssize_t frontpanel_write(struct usb_frontpanel *dev, const char *buffer, size_t count,
+				ktime_t sampled, bool urgent)
+{
+	int retval = 0;
+	struct frontpanel_slot *slot = NULL;
+	struct urb *urb = NULL;
+	char *buf = NULL;
+	size_t writesize = min_t(size_t, count, PANEL_DATA_SIZE);
+	ktime_t start = ktime_get();
+
+	/*
+	 * limit the number of URBs in flight to stop a user from using up all
+	 * RAM, and to what the bus currently keeps up with
+	 */
+	urgent = urgent && READ_ONCE(priority_lane);
+	if (urgent)
+		usb_unlink_anchored_urbs(&dev->submitted);
+	if (atomic_inc_return(&dev->in_flight) >
+	    (urgent ? WRITES_IN_FLIGHT : READ_ONCE(dev->depth))) {
+		atomic_dec(&dev->in_flight);
+		retval = -EAGAIN;
+		goto exit;
+	}
+
+	/* any error is reported once */
+	retval = atomic_xchg(&dev->errors, 0);
+	if (retval < 0) {
+		/* to preserve notifications about reset */
+		retval = (retval == -EPIPE) ? retval : -EIO;
+		goto error;
+	}
+
+	/* create a urb, and a buffer for it, and copy the data to the urb */
+	urb = frontpanel_should_fail(fp_fail_urb_alloc) ? NULL :
+		usb_alloc_urb(0, GFP_KERNEL);
+	if (!urb) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	slot = frontpanel_get_slot(dev);
+	slot->sampled = sampled;
+	slot->urgent = urgent;
+
+	buf = frontpanel_alloc_buffer(dev, slot, urb, writesize);
+	if (!buf) {
+		retval = -ENOMEM;
+		goto error;
+	}
+
+	memcpy(buf, buffer, writesize);
+
+	/* this lock makes sure we don't submit URBs to gone devices */
+	mutex_lock(&dev->io_mutex);
+	if (dev->disconnected) {		/* disconnect() was called */
+		mutex_unlock(&dev->io_mutex);
+		retval = -ENODEV;
+		goto error;
+	}
+
+	/* initialize the urb properly */
+	usb_fill_bulk_urb(urb, dev->udev,
+			  usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
+			  buf, writesize, frontpanel_write_bulk_callback, slot);
+	usb_anchor_urb(urb, urgent ? &dev->urgent : &dev->submitted);
+
+	/* send the data out the bulk port */
+	slot->submitted = ktime_get();
+	if (frontpanel_should_fail(fp_fail_submit))
+		retval = -EIO;
+	else
+		retval = usb_submit_urb(urb, GFP_KERNEL);
+	mutex_unlock(&dev->io_mutex);
+	if (retval) {
+		dev_err(&dev->interface->dev,
+			"%s - failed submitting write urb, error %d\n",
+			__func__, retval);
+		goto error_unanchor;
+	}
+
+	/*
+	 * release our reference to this urb, the USB core will eventually free
+	 * it entirely
+	 */
+	usb_free_urb(urb);
+	this_cpu_inc(fp_stats->frames_submitted);
+	this_cpu_add(fp_stats->submit_ns, ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+	return writesize;
+
+error_unanchor:
+	usb_unanchor_urb(urb);
+error:
+	if (urb) {
+		if (buf)
+			frontpanel_free_buffer(dev, urb, buf, writesize);
+		usb_free_urb(urb);
+	}
+	if (slot)
+		frontpanel_put_slot(slot);
+	atomic_dec(&dev->in_flight);
+
+exit:
+	return retval;
+}
 
-		spin_lock_irqsave(&dev->err_lock, flags);
-		dev->errors = urb->status;
-		spin_unlock_irqrestore(&dev->err_lock, flags);
+/*
+ * On hybrid and big.LITTLE machines a busy little core doesn't do the work
+ * of a busy big one. With capacity_scale each CPU's load is weighted by its
+ * capacity relative to the biggest CPU, so the LEDs show shares of the
+ * machine's compute capacity. The capacities are read once a CPU comes
+ * online, not per tick.
+ */
+static bool capacity_scale;
+module_param(capacity_scale, bool, 0644);
+MODULE_PARM_DESC(capacity_scale, "Weight CPU loads by the CPUs' compute capacity");
+
+static unsigned int fp_capacity[PANEL_MAX_CPUS];
+static enum cpuhp_state fp_cpuhp;
+
+static int frontpanel_cpu_online(unsigned int cpu)
+{
+	if (cpu < PANEL_MAX_CPUS)
+		WRITE_ONCE(fp_capacity[cpu], arch_scale_cpu_capacity(cpu));
+	return 0;
+}
+
+/* SCHED_CAPACITY_SCALE for the biggest CPUs and when not weighting at all */
+static unsigned int rackmeter_capacity(unsigned int cpu, bool scale)
+{
+	return scale ? READ_ONCE(fp_capacity[cpu]) : SCHED_CAPACITY_SCALE;
+}
+
+/* turn the per-CPU loads into LED values, returns whether any LED changed */
+#if PANEL_MAX_CPUS <= PANEL_CHANNELS
+static unsigned int rackmeter_render(struct usb_frontpanel *dev, __u8 *frame)
+{
+	bool scale = READ_ONCE(capacity_scale) && READ_ONCE(dev->mode) == FP_MODE_CPU;
+	unsigned int ch, v, updated = 0;
+
+	/* one CPU per LED, the loop bound is a constant */
+	for (ch = 0; ch < PANEL_MAX_CPUS; ch++) {
+		v = dev->cpu[ch].load * rackmeter_capacity(ch, scale) >> SCHED_CAPACITY_SHIFT;
+		if (frame[ch] != v) {
+			frame[ch] = v;
+			updated = 1;
+		}
+	}
+
+	return updated;
+}
+#else
+static unsigned int rackmeter_render(struct usb_frontpanel *dev, __u8 *frame)
+{
+	bool scale = READ_ONCE(capacity_scale) && READ_ONCE(dev->mode) == FP_MODE_CPU;
+	unsigned int ch, cpu, first, n, sum, v, updated = 0;
+
+	/*
+	 * average the online CPUs of each contiguous group, a group mixing
+	 * core types counts each by its capacity
+	 */
+	for (ch = 0; ch < PANEL_CHANNELS; ch++) {
+		first = ch * dev->cpus_per_channel;
+		sum = n = 0;
+		for (cpu = first; cpu < first + dev->cpus_per_channel &&
+			     cpu < PANEL_MAX_CPUS; cpu++) {
+			if (!cpu_online(cpu))
+				continue;
+			sum += dev->cpu[cpu].load * rackmeter_capacity(cpu, scale);
+			n++;
+		}
+		if (!n)
+			continue;
+
+		v = sum / n >> SCHED_CAPACITY_SHIFT;
+		if (frame[ch] != v) {
+			frame[ch] = v;
+			updated = 1;
+		}
+	}
+
+	return updated;
+}
+#endif
+
+static unsigned int rackmeter_cpu_channel(struct usb_frontpanel *dev, unsigned int cpu)
+{
+#if PANEL_MAX_CPUS > PANEL_CHANNELS
+	return cpu / dev->cpus_per_channel;
+#else
+	return cpu;
+#endif
+}
+
+/* returns whether the CPU wasn't alerting already */
+static bool rackmeter_raise_alert(struct rackmeter_cpu *rcpu)
+{
+	bool raised = !rcpu->alert;
+
+	if (raised)
+		this_cpu_inc(fp_stats->alerts);
+	rcpu->alert = ANOMALY_HOLD;
+	return raised;
+}
+
+/* returns whether a new alert was raised */
+static bool rackmeter_detect_anomalies(struct usb_frontpanel *dev)
+{
+	unsigned int k = READ_ONCE(anomaly_sigma);
+	u32 pkg_sum[ANOMALY_MAX_PACKAGES] = { }, pkg_n[ANOMALY_MAX_PACKAGES] = { };
+	u32 sum = 0, n = 0;
+	unsigned int cpu, pkg, packages = 0;
+	bool raised = false;
+	s64 delta, floor = (s64)ANOMALY_MIN_SIGMA * ANOMALY_MIN_SIGMA << 16;
+
+	/* the baselines are of CPU load, other modes leave them alone */
+	if (READ_ONCE(dev->mode) != FP_MODE_CPU)
+		return false;
+
+	dev->blink = !dev->blink;
+
+	for_each_online_cpu(cpu) {
+		struct rackmeter_cpu *rcpu;
+		s32 x;
+
+		if (cpu >= PANEL_MAX_CPUS)
+			break;
+		rcpu = &dev->cpu[cpu];
+		x = rcpu->load << 8;
+
+		if (rcpu->alert)
+			rcpu->alert--;
+
+		/* judge the sample against the baseline before it moves */
+		delta = x - rcpu->mean;
+		if (k && rcpu->samples >= ANOMALY_WARMUP &&
+		    delta * delta > (s64)k * k * max(rcpu->var, floor))
+			raised |= rackmeter_raise_alert(rcpu);
+
+		if (rcpu->samples < ANOMALY_WINDOW)
+			rcpu->samples++;
+		rcpu->mean += div_s64(delta, rcpu->samples);
+		rcpu->var += div_s64(delta * (x - rcpu->mean) - rcpu->var, rcpu->samples);
+
+		pkg = topology_physical_package_id(cpu);
+		if (pkg < ANOMALY_MAX_PACKAGES) {
+			if (!pkg_n[pkg])
+				packages++;
+			pkg_sum[pkg] += rcpu->load;
+			pkg_n[pkg]++;
+			sum += rcpu->load;
+			n++;
+		}
+	}
+
+	if (!k || packages < 2)
+		return raised;
+
+	/* a package against the CPUs of all the others */
+	for (pkg = 0; pkg < ANOMALY_MAX_PACKAGES; pkg++) {
+		if (!pkg_n[pkg] || pkg_n[pkg] == n)
+			continue;
+		if (abs((s32)(pkg_sum[pkg] / pkg_n[pkg]) -
+			(s32)((sum - pkg_sum[pkg]) / (n - pkg_n[pkg]))) <= ANOMALY_PACKAGE_GAP)
+			continue;
+
+		for_each_online_cpu(cpu) {
+			if (cpu >= PANEL_MAX_CPUS)
+				break;
+			if (topology_physical_package_id(cpu) == pkg)
+				raised |= rackmeter_raise_alert(&dev->cpu[cpu]);
+		}
+	}
+
+	return raised;
+}
+
+/* alerting CPUs blink their LED over whatever the mode rendered */
+static unsigned int rackmeter_render_alerts(struct usb_frontpanel *dev, __u8 *frame)
+{
+	unsigned int cpu, updated = 0;
+
+	for_each_online_cpu(cpu) {
+		if (cpu >= PANEL_MAX_CPUS)
+			break;
+		if (!dev->cpu[cpu].alert)
+			continue;
+		frame[rackmeter_cpu_channel(dev, cpu)] = dev->blink ? 255 : 0;
+		updated = 1;
+	}
+
+	return updated;
+}
+
+static void rackmeter_update_trend(struct usb_frontpanel *dev)
+{
+	bool scale = READ_ONCE(capacity_scale);
+	enum frontpanel_mode mode;
+	unsigned int cpu, n = 0, i;
+	u64 sum = 0;
+	s64 mean;
+
+	/*
+	 * the means are of CPU load, as are the loads in trend mode; locks and
+	 * softnet loads aren't, and the CPUs out of view aren't sampled
+	 */
+	mode = READ_ONCE(dev->mode);
+	if (mode != FP_MODE_CPU && mode != FP_MODE_TREND)
+		return;
+
+	for_each_online_cpu(cpu) {
+		if (cpu >= PANEL_MAX_CPUS)
+			break;
+		sum += dev->cpu[cpu].load * rackmeter_capacity(cpu, scale);
+		n++;
+	}
+	if (!n)
+		return;
+	mean = div_u64(sum << (TREND_SHIFT - SCHED_CAPACITY_SHIFT), n);
+
+	for (i = 0; i < TREND_ROWS; i++)
+		dev->trend[i] += ((mean - dev->trend[i]) * fp_trend_alpha[i]) >> TREND_SHIFT;
+}
+
+/* fill n LEDs like a bar graph, the last lit one dimmed by the remainder */
+static unsigned int rackmeter_render_bar(__u8 *leds, unsigned int n, unsigned int value)
+{
+	int fill = value * n, i;
+	unsigned int updated = 0;
+	__u8 v;
+
+	for (i = 0; i < n; i++) {
+		v = clamp(fill - i * 255, 0, 255);
+		if (leds[i] != v) {
+			leds[i] = v;
+			updated = 1;
+		}
+	}
+
+	return updated;
+}
+
+static unsigned int rackmeter_render_trend(struct usb_frontpanel *dev, __u8 *frame)
+{
+	unsigned int i, updated = 0;
+	const unsigned int n = PANEL_CHANNELS / TREND_ROWS;
+
+	for (i = 0; i < TREND_ROWS; i++)
+		updated |= rackmeter_render_bar(frame + i * n, n,
+						dev->trend[i] >> TREND_SHIFT);
+
+	return updated;
+}
+
+/* the CPUs in view, in order, one per LED */
+static unsigned int rackmeter_render_view(struct usb_frontpanel *dev, __u8 *frame)
+{
+	unsigned int cpu, ch = 0, updated = 0;
+	__u8 v;
+
+	for_each_set_bit(cpu, dev->view_tick, PANEL_MAX_CPUS) {
+		v = cpu_online(cpu) ? dev->cpu[cpu].load : 0;
+		if (frame[ch] != v) {
+			frame[ch] = v;
+			updated = 1;
+		}
+		ch++;
+	}
+	for (; ch < PANEL_CHANNELS; ch++) {
+		if (frame[ch]) {
+			frame[ch] = 0;
+			updated = 1;
+		}
+	}
+
+	return updated;
+}
+
+static unsigned int rackmeter_render_frame(struct usb_frontpanel *dev, __u8 *frame)
+{
+	unsigned int updated;
+
+	switch (READ_ONCE(dev->mode)) {
+	case FP_MODE_CPU:
+		updated = rackmeter_render(dev, frame);
+		return rackmeter_render_alerts(dev, frame) | updated;
+	case FP_MODE_TREND:
+		return rackmeter_render_trend(dev, frame);
+	case FP_MODE_VIEW:
+		return rackmeter_render_view(dev, frame);
+	default:
+		return rackmeter_render(dev, frame);
+	}
+}
+
+/*
+ * Lock contention heat: the contention_begin/end tracepoints are only hooked
+ * while a panel is in "locks" mode. Only spinning waits are accounted, those
+ * burn the CPU they started on and cannot migrate; a sleeping wait is not
+ * CPU time. A nested wait (from an interrupt) is already covered by the
+ * outer one.
+ */
+struct frontpanel_lockstat {
+	void			*lock;			/* being spun on, or NULL */
+	u64			start;
+	u64			wait_ns;
+};
+
+static DEFINE_PER_CPU(struct frontpanel_lockstat, fp_lockstat);
+static DEFINE_MUTEX(fp_mode_lock);
+
+/* the contention tracepoints are only exported to modules from 6.7 on */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 7, 0)
+static unsigned int fp_lock_users;
+
+static void frontpanel_contention_end(void *data, void *lock, int ret)
+{
+	struct frontpanel_lockstat *ls = this_cpu_ptr(&fp_lockstat);
+
+	if (ls->lock != lock)
+		return;
+	ls->wait_ns += local_clock() - ls->start;
+	ls->lock = NULL;
+}
+
+static void frontpanel_contention_begin(void *data, void *lock, unsigned int flags)
+{
+	struct frontpanel_lockstat *ls = this_cpu_ptr(&fp_lockstat);
+
+	/* a mutex gives up optimistic spinning with a second, sleeping begin */
+	if (!(flags & LCB_F_SPIN)) {
+		frontpanel_contention_end(data, lock, 0);
+		return;
+	}
+	if (ls->lock)
+		return;
+	ls->start = local_clock();
+	ls->lock = lock;
+}
+
+static int frontpanel_locks_get(void)
+{
+	unsigned int cpu;
+	int retval = 0;
+
+	lockdep_assert_held(&fp_mode_lock);
+	if (fp_lock_users++)
+		return 0;
+
+	/* a wait the probes were removed in the middle of never ends */
+	for_each_possible_cpu(cpu) {
+		per_cpu(fp_lockstat, cpu).lock = NULL;
+		per_cpu(fp_lockstat, cpu).start = 0;
+	}
+
+	retval = register_trace_contention_begin(frontpanel_contention_begin, NULL);
+	if (retval)
+		goto error;
+	retval = register_trace_contention_end(frontpanel_contention_end, NULL);
+	if (retval) {
+		unregister_trace_contention_begin(frontpanel_contention_begin, NULL);
+		goto error;
+	}
+
+	return 0;
+
+error:
+	fp_lock_users--;
+	return retval;
+}
+
+static void frontpanel_locks_put(void)
+{
+	lockdep_assert_held(&fp_mode_lock);
+	if (--fp_lock_users)
+		return;
+
+	unregister_trace_contention_end(frontpanel_contention_end, NULL);
+	unregister_trace_contention_begin(frontpanel_contention_begin, NULL);
+	tracepoint_synchronize_unregister();
+}
+#else
+static int frontpanel_locks_get(void)
+{
+	return -EOPNOTSUPP;
+}
+
+static void frontpanel_locks_put(void) { }
+#endif
+
+/* share of the window this CPU spent spinning on contended locks */
+static __u8 rackmeter_locks_load(struct rackmeter_cpu *rcpu, unsigned int cpu,
+				 s64 diff_wall)
+{
+	u64 wait_ns = READ_ONCE(per_cpu(fp_lockstat, cpu).wait_ns);
+	u64 diff_wait = wait_ns - rcpu->prev_lock_ns;
+
+	rcpu->prev_lock_ns = wait_ns;
+
+	return min_t(u64, div64_u64(255 * diff_wait, diff_wall * NSEC_PER_USEC), 255);
+}
+
+/*
+ * Packet receive saturation from the CPU's softnet_data, read in the same
+ * sweep as the idle times. Over the window:
+ *
+ *   packets only		up to 120, 8 per doubling of the packets
+ *   NAPI out of budget or time	128 and up, 16 per time_squeeze
+ *   backlog drops		255
+ */
+static u32 rackmeter_softnet_dropped(unsigned int cpu)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+	return atomic_read(&per_cpu(softnet_data, cpu).dropped);
+#else
+	return READ_ONCE(per_cpu(softnet_data, cpu).dropped);
+#endif
+}
+
+static void rackmeter_softnet_prime(struct rackmeter_cpu *rcpu, unsigned int cpu)
+{
+	struct softnet_data *sd = &per_cpu(softnet_data, cpu);
+
+	rcpu->prev_processed = READ_ONCE(sd->processed);
+	rcpu->prev_squeezed = READ_ONCE(sd->time_squeeze);
+	rcpu->prev_dropped = rackmeter_softnet_dropped(cpu);
+}
+
+static __u8 rackmeter_softnet_load(struct rackmeter_cpu *rcpu, unsigned int cpu)
+{
+	u32 processed = rcpu->prev_processed, squeezed = rcpu->prev_squeezed;
+	u32 dropped = rcpu->prev_dropped;
+
+	rackmeter_softnet_prime(rcpu, cpu);
+	processed = rcpu->prev_processed - processed;
+	squeezed = rcpu->prev_squeezed - squeezed;
+	dropped = rcpu->prev_dropped - dropped;
+
+	if (dropped)
+		return 255;
+	if (squeezed)
+		return 128 + min_t(u32, squeezed * 16, 126);
+	if (processed)
+		return min_t(unsigned int, 8 * (ilog2(processed) + 1), 120);
+	return 0;
+}
+
+/*
+ * Event-driven sampling: the scheduler calls the cpufreq update_util hook of
+ * a CPU whenever its utilisation changes, at least every scheduler tick
+ * while it runs something. The hook folds that CPU's busy share since its
+ * last fold into a per-CPU slot, at most every SCHED_HOOK_INTERVAL_NS, and
+ * the sampler only reads the slots. A CPU whose slot went stale sits idle
+ * without ticks (or is nohz_full) and is polled as before.
+ *
+ * There is one hook per CPU, shared with the governors: schedutil, ondemand,
+ * conservative and setpolicy drivers such as intel_pstate install theirs, so
+ * the hooks are only taken when no CPU is run by any of those. A policy
+ * created later (a CPU brought up, the cpufreq driver loaded) starts its
+ * governor right after the policy notifier ran, so the hooks are given up
+ * there and the stale slots make the sampler poll. Switching an existing
+ * policy to such a governor has no notifier and still leaves it without
+ * updates.
+ */
+#define SCHED_HOOK_INTERVAL_NS	(CPU_SAMPLING_RATE * NSEC_PER_MSEC / 4)
+
+static bool sched_hooks;
+module_param(sched_hooks, bool, 0444);
+MODULE_PARM_DESC(sched_hooks, "Sample from the cpufreq update_util hooks instead of polling");
+
+struct rackmeter_hook {
+	struct update_util_data	uud;
+	u64			next;			/* earliest next fold, rq clock */
+	u64			prev_idle;
+	u64			prev_wall;
+	unsigned long		stamp;			/* jiffies of the last fold */
+	__u8			load;
+};
+
+static DEFINE_PER_CPU(struct rackmeter_hook, fp_hook);
+static DEFINE_MUTEX(fp_hook_lock);
+static unsigned int fp_hook_users;
+static bool fp_hooks_installed;
+static bool fp_hook_notifier;
+
+static void rackmeter_hook_update(struct update_util_data *data, u64 time, unsigned int flags)
+{
+	struct rackmeter_hook *hook = container_of(data, struct rackmeter_hook, uud);
+	u64 idle, wall;
+	s64 diff_idle, diff_wall;
+
+	if (time < hook->next)
+		return;
+	hook->next = time + SCHED_HOOK_INTERVAL_NS;
+
+	idle = get_cpu_idle_time(smp_processor_id(), &wall, 0);
+	diff_idle = idle - hook->prev_idle;
+	diff_wall = wall - hook->prev_wall;
+	if (hook->prev_wall && diff_wall > 0) {
+		if (diff_idle > diff_wall)
+			diff_idle = diff_wall;
+		WRITE_ONCE(hook->load, div64_u64(255 * (diff_wall - diff_idle), diff_wall));
+		WRITE_ONCE(hook->stamp, jiffies);
+	}
+	WRITE_ONCE(hook->prev_idle, idle);
+	WRITE_ONCE(hook->prev_wall, wall);
+}
+
+/* whether some CPU's frequency is managed through the update_util hooks */
+static bool rackmeter_hooks_taken(void)
+{
+	static const char * const hookless[] = { "performance", "powersave", "userspace" };
+	struct cpufreq_policy *policy;
+	bool taken = false;
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		policy = cpufreq_cpu_get(cpu);
+		if (!policy)
+			continue;
+		taken = !policy->governor ||
+			match_string(hookless, ARRAY_SIZE(hookless), policy->governor->name) < 0;
+		cpufreq_cpu_put(policy);
+		if (taken)
+			break;
+	}
+
+	return taken;
+}
+
+static int rackmeter_hooks_get(void)
+{
+	unsigned int cpu;
+	int retval = 0;
+
+	mutex_lock(&fp_hook_lock);
+	if (fp_hook_users)
+		goto out;
+
+	if (rackmeter_hooks_taken()) {
+		retval = -EBUSY;
+		goto out;
+	}
+	for_each_possible_cpu(cpu) {
+		per_cpu(fp_hook, cpu).next = 0;
+		cpufreq_add_update_util_hook(cpu, &per_cpu(fp_hook, cpu).uud,
+					     rackmeter_hook_update);
+	}
+	fp_hooks_installed = true;
+out:
+	if (!retval)
+		fp_hook_users++;
+	mutex_unlock(&fp_hook_lock);
+	return retval;
+}
+
+/* called with fp_hook_lock held */
+static void rackmeter_hooks_remove(void)
+{
+	unsigned int cpu;
+
+	if (!fp_hooks_installed)
+		return;
+	for_each_possible_cpu(cpu)
+		cpufreq_remove_update_util_hook(cpu);
+	fp_hooks_installed = false;
+	/* no hook may still run when they are installed again */
+	synchronize_rcu();
+}
+
+static void rackmeter_hooks_put(void)
+{
+	mutex_lock(&fp_hook_lock);
+	if (!--fp_hook_users)
+		rackmeter_hooks_remove();
+	mutex_unlock(&fp_hook_lock);
+}
+
+/*
+ * A new policy's governor may want the hooks. The users keep counting, the
+ * hooks are taken again once the last of them let go and another panel
+ * finds them free.
+ */
+static int rackmeter_policy_notifier(struct notifier_block *nb,
+				     unsigned long event, void *data)
+{
+	if (event != CPUFREQ_CREATE_POLICY)
+		return NOTIFY_DONE;
+
+	mutex_lock(&fp_hook_lock);
+	if (fp_hooks_installed) {
+		rackmeter_hooks_remove();
+		pr_warn("xserve-frontpanel: new cpufreq policy, polling instead of the scheduler hooks\n");
+	}
+	mutex_unlock(&fp_hook_lock);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block rackmeter_policy_nb = {
+	.notifier_call = rackmeter_policy_notifier,
+};
+
+/*
+ * Registered once at load rather than with the hooks: the notifier runs
+ * under the chain's lock and takes fp_hook_lock.
+ */
+static void rackmeter_policy_register(void)
+{
+	if (sched_hooks)
+		fp_hook_notifier = !cpufreq_register_notifier(&rackmeter_policy_nb,
+							      CPUFREQ_POLICY_NOTIFIER);
+}
+
+static void rackmeter_policy_unregister(void)
+{
+	if (fp_hook_notifier)
+		cpufreq_unregister_notifier(&rackmeter_policy_nb,
+					    CPUFREQ_POLICY_NOTIFIER);
+	fp_hook_notifier = false;
+}
+
+/*
+ * Take the load the hook folded, if it is recent, and log the window from
+ * the previous take to the hook's last fold. Otherwise the CPU is polled,
+ * from the hook's last fold when that is newer than our own baseline; a
+ * fold racing with this only skews one sample.
+ */
+static bool rackmeter_hook_load(struct rackmeter_cpu *rcpu, unsigned int cpu)
+{
+	struct rackmeter_hook *hook = per_cpu_ptr(&fp_hook, cpu);
+	bool fresh = time_before(jiffies, READ_ONCE(hook->stamp) +
+				 2 * msecs_to_jiffies(CPU_SAMPLING_RATE));
+	u64 idle, wall;
+
+	if (fresh)
+		rcpu->load = READ_ONCE(hook->load);
+
+	wall = READ_ONCE(hook->prev_wall);
+	idle = READ_ONCE(hook->prev_idle);
+	if (wall > rcpu->prev_wall) {
+		if (fresh && rcpu->prev_wall)
+			rackmeter_log_load(cpu, rcpu->load, wall, wall - rcpu->prev_wall,
+					   idle - rcpu->prev_idle, true);
+		rcpu->prev_idle = idle;
+		rcpu->prev_wall = wall;
+	}
+	return fresh;
+}
+
+/*
+ * View mode zooms into up to PANEL_CHANNELS CPUs, a list or a NUMA node, at
+ * one CPU per LED, and only those are sampled. With view_pan_ms the view
+ * moves on to the next CPUs or node after that long.
+ */
+static unsigned int view_pan_ms;
+module_param(view_pan_ms, uint, 0644);
+MODULE_PARM_DESC(view_pan_ms, "Move the view to the next CPUs or node after this long (0 = never)");
+
+/* keep the first PANEL_CHANNELS CPUs */
+static void rackmeter_view_trim(unsigned long *view)
+{
+	unsigned int cpu, n = 0;
+
+	for_each_set_bit(cpu, view, PANEL_MAX_CPUS)
+		if (++n > PANEL_CHANNELS)
+			clear_bit(cpu, view);
+}
+
+static void rackmeter_view_node(unsigned long *view, int node)
+{
+	unsigned int cpu;
+
+	bitmap_zero(view, PANEL_MAX_CPUS);
+	for_each_cpu(cpu, cpumask_of_node(node)) {
+		if (cpu >= PANEL_MAX_CPUS)
+			break;
+		set_bit(cpu, view);
+	}
+	rackmeter_view_trim(view);
+}
+
+static void rackmeter_view_pan(struct usb_frontpanel *dev)
+{
+	unsigned int limit = min_t(unsigned int, nr_cpu_ids, PANEL_MAX_CPUS);
+	unsigned int first;
+
+	lockdep_assert_held(&dev->view_lock);
+
+	if (dev->view_node != NUMA_NO_NODE) {
+		dev->view_node = next_online_node(dev->view_node);
+		if (dev->view_node >= MAX_NUMNODES)
+			dev->view_node = first_online_node;
+		rackmeter_view_node(dev->view, dev->view_node);
+		return;
+	}
+
+	first = find_last_bit(dev->view, PANEL_MAX_CPUS) + 1;
+	if (first >= limit)
+		first = 0;
+	bitmap_zero(dev->view, PANEL_MAX_CPUS);
+	bitmap_set(dev->view, first, min_t(unsigned int, PANEL_CHANNELS, limit - first));
+}
+
+static void rackmeter_view_update(struct usb_frontpanel *dev)
+{
+	unsigned int pan = READ_ONCE(view_pan_ms);
+
+	spin_lock(&dev->view_lock);
+	if (pan && time_after_eq(jiffies, dev->view_since + msecs_to_jiffies(pan))) {
+		rackmeter_view_pan(dev);
+		dev->view_since = jiffies;
+	}
+	bitmap_copy(dev->view_tick, dev->view, PANEL_MAX_CPUS);
+	spin_unlock(&dev->view_lock);
+}
+
+/* returns the CPU's wall time at the sample, in us */
+static u64 rackmeter_sample_cpu(struct usb_frontpanel *dev, unsigned int cpu,
+				enum frontpanel_mode mode)
+{
+	struct rackmeter_cpu *rcpu = &dev->cpu[cpu];
+	u64 cpu_idle, cpu_wall = 0;
+	s64 diff_idle, diff_wall;
+
+	cpu_idle = get_cpu_idle_time(cpu, &cpu_wall, 0);
+	diff_idle = cpu_idle - rcpu->prev_idle;
+	diff_wall = cpu_wall - rcpu->prev_wall;
+	if (diff_idle > diff_wall)
+		diff_wall = diff_idle;
+
+	/* a CPU the view panned back to has a baseline from long ago */
+	if (mode == FP_MODE_VIEW &&
+	    diff_wall > 4LL * CPU_SAMPLING_RATE * USEC_PER_MSEC) {
+		rcpu->prev_wall = 0;
+		rcpu->load = 0;
+	}
+
+	/*
+	 * We do a very dumb calculation to update the LEDs for now,
+	 * a CPU without a baseline yet (onlined later) just gets one
+	 */
+	if (rcpu->prev_wall && diff_wall > 0) {
+		if (mode == FP_MODE_LOCKS)
+			rcpu->load = rackmeter_locks_load(rcpu, cpu, diff_wall);
+		else if (mode == FP_MODE_SOFTNET)
+			rcpu->load = rackmeter_softnet_load(rcpu, cpu);
+		else
+			rcpu->load = div64_u64(255 * (diff_wall - diff_idle), diff_wall);
+
+		if (mode != FP_MODE_LOCKS && mode != FP_MODE_SOFTNET)
+			rackmeter_log_load(cpu, rcpu->load, cpu_wall, diff_wall,
+					   diff_idle, false);
+	}
+
+	rcpu->prev_idle = cpu_idle;
+	rcpu->prev_wall = cpu_wall;
+
+	return cpu_wall;
+}
+
+/*
+ * Sample every CPU once, or just those in view. The CPUs are read one after
+ * another, so each load is taken over that CPU's own wall interval: the
+ * sweep position shifts both ends of the window alike and the busy/wall
+ * ratio stays comparable between CPUs. What is left is the sweep skew,
+ * returned in ns so it can be watched.
+ */
+static u64 rackmeter_sample(struct usb_frontpanel *dev)
+{
+	enum frontpanel_mode mode = READ_ONCE(dev->mode);
+	unsigned int cpu;
+	unsigned int chunk = READ_ONCE(sample_chunk), n = 0;
+	u64 cpu_wall = 0, first_wall = 0;
+
+	if (mode == FP_MODE_VIEW) {
+		rackmeter_view_update(dev);
+		for_each_set_bit(cpu, dev->view_tick, PANEL_MAX_CPUS) {
+			if (!cpu_online(cpu))
+				continue;
+			cpu_wall = rackmeter_sample_cpu(dev, cpu, mode);
+			if (!first_wall)
+				first_wall = cpu_wall;
+		}
+		goto out;
+	}
+
+	for_each_online_cpu(cpu) {
+		if (cpu >= PANEL_MAX_CPUS)
+			break;
+
+		if (chunk && ++n % chunk == 0)
+			cond_resched();
+
+		if (dev->hooked && mode == FP_MODE_CPU &&
+		    rackmeter_hook_load(&dev->cpu[cpu], cpu))
+			continue;
+
+		cpu_wall = rackmeter_sample_cpu(dev, cpu, mode);
+		if (!first_wall)
+			first_wall = cpu_wall;
+	}
+
+out:
+	/* get_cpu_idle_time() reports wall time in us */
+	return first_wall ? (cpu_wall - first_wall) * NSEC_PER_USEC : 0;
+}
+
+/*
+ * The per-CPU loads of the last tick, for other kernel code and BPF
+ * programs that want the panel's view of the machine without computing
+ * it again. A latch keeps two copies, so readers never wait, not even in
+ * NMI context, and always see the loads of a single tick.
+ */
+struct rackmeter_snapshot {
+	u64			stamp_ns;		/* CLOCK_MONOTONIC, 0 if never taken */
+	__u8			load[PANEL_MAX_CPUS];	/* over the last sampling period */
+	__u8			avg[PANEL_MAX_CPUS];	/* over the last ANOMALY_WINDOW periods */
+};
+
+static struct {
+	seqcount_latch_t	seq;
+	struct rackmeter_snapshot data[2];
+} fp_snapshot = {
+	.seq = SEQCNT_LATCH_ZERO(fp_snapshot.seq),
+};
+
+/* the latch helpers before 6.13 are the raw ones, without KCSAN annotations */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+#define write_seqcount_latch_begin(s)		raw_write_seqcount_latch(s)
+#define write_seqcount_latch(s)			raw_write_seqcount_latch(s)
+#define write_seqcount_latch_end(s)		do { } while (0)
+#define read_seqcount_latch(s)			raw_read_seqcount_latch(s)
+#define read_seqcount_latch_retry(s, start)	read_seqcount_retry(&(s)->seqcount, start)
+#endif
+static DEFINE_SPINLOCK(fp_snapshot_lock);		/* between panels */
+
+/* only CPU loads are published, the other modes keep the last ones */
+static void rackmeter_publish(struct usb_frontpanel *dev, ktime_t now)
+{
+	struct rackmeter_snapshot *snap = &fp_snapshot.data[0];
+	unsigned int cpu;
+
+	if (READ_ONCE(dev->mode) != FP_MODE_CPU)
+		return;
+
+	spin_lock(&fp_snapshot_lock);
+	write_seqcount_latch_begin(&fp_snapshot.seq);
+	for (cpu = 0; cpu < PANEL_MAX_CPUS; cpu++) {
+		snap->load[cpu] = dev->cpu[cpu].load;
+		snap->avg[cpu] = clamp(dev->cpu[cpu].mean >> 8, 0, 255);
+	}
+	snap->stamp_ns = ktime_to_ns(now);
+	write_seqcount_latch(&fp_snapshot.seq);
+	fp_snapshot.data[1] = *snap;
+	write_seqcount_latch_end(&fp_snapshot.seq);
+	spin_unlock(&fp_snapshot_lock);
+}
+
+/* the fast clock may trail the sampler's a little */
+static bool rackmeter_snapshot_stale(u64 stamp)
+{
+	return !stamp ||
+	       (s64)(ktime_get_mono_fast_ns() - stamp) > 4LL * CPU_SAMPLING_RATE * NSEC_PER_MSEC;
+}
+
+/**
+ * xserve_panel_cpu_load - the front panel's view of a CPU's load
+ * @cpu: the CPU
+ * @avg: the load averaged over the last seconds instead of the last period
+ *
+ * Lockless, callable from any context.
+ *
+ * Return: the load from 0 (idle) to 255 (busy), -EINVAL for a CPU the panel
+ * doesn't sample, -ENODATA when no panel sampled CPU loads lately.
+ */
+int xserve_panel_cpu_load(unsigned int cpu, bool avg)
+{
+	struct rackmeter_snapshot *snap;
+	unsigned int seq;
+	u64 stamp;
+	int load;
+
+	if (cpu >= PANEL_MAX_CPUS)
+		return -EINVAL;
+
+	do {
+		seq = read_seqcount_latch(&fp_snapshot.seq);
+		snap = &fp_snapshot.data[seq & 1];
+		stamp = snap->stamp_ns;
+		load = avg ? snap->avg[cpu] : snap->load[cpu];
+	} while (read_seqcount_latch_retry(&fp_snapshot.seq, seq));
+
+	if (rackmeter_snapshot_stale(stamp))
+		return -ENODATA;
+
+	return load;
+}
+EXPORT_SYMBOL_GPL(xserve_panel_cpu_load);
+
+/**
+ * xserve_panel_cpu_loads - the front panel's view of the loads of all CPUs
+ * @load: the loads over the last sampling period, or NULL
+ * @avg: the loads averaged over the last seconds, or NULL
+ * @nr: room in @load and @avg, in CPUs from CPU 0 on
+ * @stamp_ns: CLOCK_MONOTONIC time of the tick the loads are from, or NULL
+ *
+ * All loads come from the same tick. Lockless, callable from any context.
+ *
+ * Return: the number of CPUs copied, at most PANEL_MAX_CPUS, -ENODATA when
+ * no panel sampled CPU loads lately.
+ */
+int xserve_panel_cpu_loads(u8 *load, u8 *avg, unsigned int nr, u64 *stamp_ns)
+{
+	struct rackmeter_snapshot *snap;
+	unsigned int seq;
+	u64 stamp;
+
+	nr = min_t(unsigned int, nr, PANEL_MAX_CPUS);
+	do {
+		seq = read_seqcount_latch(&fp_snapshot.seq);
+		snap = &fp_snapshot.data[seq & 1];
+		stamp = snap->stamp_ns;
+		if (load)
+			memcpy(load, snap->load, nr);
+		if (avg)
+			memcpy(avg, snap->avg, nr);
+	} while (read_seqcount_latch_retry(&fp_snapshot.seq, seq));
+
+	if (rackmeter_snapshot_stale(stamp))
+		return -ENODATA;
+	if (stamp_ns)
+		*stamp_ns = stamp;
+
+	return nr;
+}
+EXPORT_SYMBOL_GPL(xserve_panel_cpu_loads);
+
+#if IS_ENABLED(CONFIG_DEBUG_INFO_BTF_MODULES)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 0)
+#define BTF_KFUNCS_START(name)	BTF_SET8_START(name)
+#define BTF_KFUNCS_END(name)	BTF_SET8_END(name)
+#endif
+#ifndef __bpf_kfunc_start_defs
+#define __bpf_kfunc_start_defs()
+#define __bpf_kfunc_end_defs()
+#endif
+#ifndef __bpf_kfunc
+#define __bpf_kfunc		__used noinline
+#endif
+
+__bpf_kfunc_start_defs();
+
+/* xserve_panel_cpu_load() for BPF programs, sched_ext schedulers included */
+__bpf_kfunc int bpf_xserve_panel_cpu_load(u32 cpu, bool avg)
+{
+	return xserve_panel_cpu_load(cpu, avg);
+}
+
+/* xserve_panel_cpu_loads() for one of the vectors, the verifier sizes it */
+__bpf_kfunc int bpf_xserve_panel_cpu_loads(u8 *load, u32 load__sz, bool avg, u64 *stamp_ns)
+{
+	return xserve_panel_cpu_loads(avg ? NULL : load, avg ? load : NULL, load__sz,
+				      stamp_ns);
+}
+
+__bpf_kfunc_end_defs();
+
+BTF_KFUNCS_START(fp_kfunc_ids)
+BTF_ID_FLAGS(func, bpf_xserve_panel_cpu_load)
+BTF_ID_FLAGS(func, bpf_xserve_panel_cpu_loads)
+BTF_KFUNCS_END(fp_kfunc_ids)
+
+static const struct btf_kfunc_id_set fp_kfunc_set = {
+	.owner = THIS_MODULE,
+	.set = &fp_kfunc_ids,
+};
+
+/* every program type, a failure only costs the BPF access */
+static void frontpanel_kfunc_register(void)
+{
+	int retval = register_btf_kfunc_id_set(BPF_PROG_TYPE_UNSPEC, &fp_kfunc_set);
+
+	if (retval)
+		pr_warn("xserve-frontpanel: kfunc registration failed: %d\n", retval);
+}
+#else
+static void frontpanel_kfunc_register(void) { }
+#endif
+
+static void frontpanel_submit(struct work_struct *work)
+{
+	struct usb_frontpanel *dev = container_of(work, struct usb_frontpanel, submit);
+	unsigned long mask[FP_POST_LONGS];
+	unsigned int i, ch;
+	bool any = false;
+	s64 sampled = S64_MAX;
+	ssize_t ret;
+
+	/* queued before the device was quiesced, the posts wait for the restart */
+	if (READ_ONCE(dev->quiesced))
+		return;
+
+	/* the last word first: with its urgent bit come the other words of the frame */
+	for (i = FP_POST_LONGS; i--; ) {
+		mask[i] = atomic_long_xchg(&dev->posted_mask[i], 0);
+		any |= mask[i];
+	}
+	if (!any)
+		return;
+
+	/* latency is counted from the oldest LED value in the frame */
+	for_each_set_bit(ch, mask, PANEL_CHANNELS) {
+		dev->submit_frame[ch] = READ_ONCE(dev->posted[ch]);
+		sampled = min(sampled, READ_ONCE(dev->posted_ns[ch]));
+	}
+
+	ret = frontpanel_write(dev, dev->submit_frame, PANEL_DATA_SIZE,
+			       sampled != S64_MAX ? ns_to_ktime(sampled) : ktime_get(),
+			       test_bit(FP_POST_URGENT, mask));
+	if (ret > 0) {
+		memcpy(fp_stash, dev->submit_frame, PANEL_CHANNELS);
+		return;
+	}
+
+	/*
+	 * a full queue just means the panel is lagging, the frame goes again
+	 * on a completion and isn't lost. A completion that ran between our
+	 * taking the mask and putting it back found nothing to kick, so look
+	 * at in_flight again once the bits are visible.
+	 */
+	if (ret == -EAGAIN) {
+		frontpanel_post_bits(dev, mask);
+		smp_mb__after_atomic();
+		if (atomic_read(&dev->in_flight) < READ_ONCE(dev->depth))
+			frontpanel_kick(dev);
+		return;
 	}
+	this_cpu_inc(fp_stats->frames_dropped);
+	dev_err(&dev->interface->dev, "write failed: %zd\n", ret);
+}
 
-	/* free up our allocated buffer */
-	usb_free_coherent(urb->dev, urb->transfer_buffer_length,
-			  urb->transfer_buffer, urb->transfer_dma);
-	up(&dev->limit_sem);
+static void rackmeter_do_timer(struct work_struct *work)
+{
+	struct usb_frontpanel *dev = container_of(work, struct usb_frontpanel, sniffer.work);
+	ktime_t now = ktime_get();
+	bool alert;
+	u64 skew;
+
+	skew = rackmeter_sample(dev);
+	this_cpu_add(fp_stats->sample_ns, ktime_to_ns(ktime_sub(ktime_get(), now)));
+	this_cpu_add(fp_stats->skew_ns, skew);
+	if (skew > this_cpu_read(fp_stats->skew_max_ns))
+		this_cpu_write(fp_stats->skew_max_ns, skew);
+	this_cpu_inc(fp_stats->ticks);
+	if (dev->last_tick) {
+		this_cpu_add(fp_stats->period_ns, ktime_to_ns(ktime_sub(now, dev->last_tick)));
+		this_cpu_inc(fp_stats->periods);
+	}
+	dev->last_tick = now;
+	rackmeter_update_trend(dev);
+	alert = rackmeter_detect_anomalies(dev);
+	rackmeter_publish(dev, now);
+
+	this_cpu_inc(fp_stats->frames_rendered);
+	if (rackmeter_render_frame(dev, dev->buffer))
+		frontpanel_post(dev, dev->buffer, NULL, now, alert);
+	else
+		this_cpu_inc(fp_stats->frames_suppressed);
+	frontpanel_history_add(dev->buffer, now);
+
+	queue_delayed_work_on(smp_processor_id(), fp_wq, &dev->sniffer, msecs_to_jiffies(CPU_SAMPLING_RATE));
 }
 
-static ssize_t frontpanel_write(struct usb_frontpanel *dev, const char *buffer, size_t count)
+static void rackmeter_init_cpu_sniffer(struct usb_frontpanel *dev)
 {
-	int retval = 0;
-	struct urb *urb = NULL;
-	char *buf = NULL;
-	size_t writesize = min_t(size_t, count, PANEL_DATA_SIZE);
+	unsigned int cpu;
+
+	INIT_DELAYED_WORK(&dev->sniffer, rackmeter_do_timer);
+
+#if PANEL_MAX_CPUS > PANEL_CHANNELS
+	dev->cpus_per_channel = DIV_ROUND_UP(min_t(unsigned int, nr_cpu_ids, PANEL_MAX_CPUS),
+					     PANEL_CHANNELS);
+#endif
 
 	/*
-	 * limit the number of URBs in flight to stop a user from using up all
-	 * RAM
+	 * prime the baselines, otherwise the first frame shows the load
+	 * averaged over the whole uptime
 	 */
-	if (down_trylock(&dev->limit_sem)) {
-		retval = -EAGAIN;
-		goto exit;
-	}
+	for_each_online_cpu(cpu) {
+		struct rackmeter_cpu *rcpu;
+		if (cpu >= PANEL_MAX_CPUS)
+			break;
+		rcpu = &dev->cpu[cpu];
 
-	spin_lock_irq(&dev->err_lock);
-	retval = dev->errors;
-	if (retval < 0) {
-		/* any error is reported once */
-		dev->errors = 0;
-		/* to preserve notifications about reset */
-		retval = (retval == -EPIPE) ? retval : -EIO;
+		rcpu->prev_idle = get_cpu_idle_time(cpu, &rcpu->prev_wall, 0);
 	}
-	spin_unlock_irq(&dev->err_lock);
-	if (retval < 0)
-		goto error;
+}
 
-	/* create a urb, and a buffer for it, and copy the data to the urb */
-	urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (!urb) {
-		retval = -ENOMEM;
-		goto error;
-	}
+static void rackmeter_start_cpu_sniffer(struct usb_frontpanel *dev)
+{
+	/* any CPU will do, the work stays there afterwards */
+	dev->last_tick = 0;
+	WRITE_ONCE(dev->quiesced, false);
+	/* what was posted while quiesced, the panel may just have been reset */
+	frontpanel_kick(dev);
+	queue_delayed_work_on(raw_smp_processor_id(), fp_wq, &dev->sniffer,
+			      msecs_to_jiffies(CPU_SAMPLING_RATE));
+}
 
-	buf = usb_alloc_coherent(dev->udev, writesize, GFP_KERNEL,
-				 &urb->transfer_dma);
-	if (!buf) {
-		retval = -ENOMEM;
-		goto error;
-	}
 
-	memcpy(buf, buffer, writesize);
+/*
+ * Also keeps the completions of the frames still in flight from submitting
+ * more, suspend, reset and disconnect drain them after this.
+ */
+static void rackmeter_stop_cpu_sniffer(struct usb_frontpanel *dev)
+{
+	WRITE_ONCE(dev->quiesced, true);
+	cancel_delayed_work_sync(&dev->sniffer);
+	cancel_work_sync(&dev->submit);
+}
 
-	/* this lock makes sure we don't submit URBs to gone devices */
-	mutex_lock(&dev->io_mutex);
-	if (dev->disconnected) {		/* disconnect() was called */
-		mutex_unlock(&dev->io_mutex);
-		retval = -ENODEV;
-		goto error;
-	}
+static int frontpanel_set_mode(struct usb_frontpanel *dev, enum frontpanel_mode mode)
+{
+	unsigned int cpu;
+	int retval = 0;
 
-	/* initialize the urb properly */
-	usb_fill_bulk_urb(urb, dev->udev,
-			  usb_sndbulkpipe(dev->udev, dev->bulk_out_endpointAddr),
-			  buf, writesize, frontpanel_write_bulk_callback, dev);
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-	usb_anchor_urb(urb, &dev->submitted);
+	mutex_lock(&fp_mode_lock);
+	if (mode == dev->mode)
+		goto out;
 
-	/* send the data out the bulk port */
-	retval = usb_submit_urb(urb, GFP_KERNEL);
-	mutex_unlock(&dev->io_mutex);
-	if (retval) {
-		dev_err(&dev->interface->dev,
-			"%s - failed submitting write urb, error %d\n",
-			__func__, retval);
-		goto error_unanchor;
-	}
+	if (mode == FP_MODE_LOCKS)
+		retval = frontpanel_locks_get();
+	if (retval)
+		goto out;
 
 	/*
-	 * release our reference to this urb, the USB core will eventually free
-	 * it entirely
+	 * the counters keep running (softnet since boot, lock waits across
+	 * earlier locks sessions), start from now
 	 */
-	usb_free_urb(urb);
-
-	return writesize;
-
-error_unanchor:
-	usb_unanchor_urb(urb);
-error:
-	if (urb) {
-		usb_free_coherent(dev->udev, writesize, buf, urb->transfer_dma);
-		usb_free_urb(urb);
+	for_each_possible_cpu(cpu) {
+		if (cpu >= PANEL_MAX_CPUS)
+			break;
+		if (mode == FP_MODE_LOCKS)
+			dev->cpu[cpu].prev_lock_ns = READ_ONCE(per_cpu(fp_lockstat, cpu).wait_ns);
+		else if (mode == FP_MODE_SOFTNET)
+			rackmeter_softnet_prime(&dev->cpu[cpu], cpu);
 	}
-	up(&dev->limit_sem);
 
-exit:
+	if (dev->mode == FP_MODE_LOCKS)
+		frontpanel_locks_put();
+	WRITE_ONCE(dev->mode, mode);
+
+out:
+	mutex_unlock(&fp_mode_lock);
 	return retval;
 }
 
-static void rackmeter_do_timer(struct work_struct *work)
+static ssize_t mode_show(struct device *d, struct device_attribute *attr, char *buf)
 {
-	struct usb_frontpanel *dev = container_of(work, struct usb_frontpanel, sniffer.work);
-
-	unsigned int load, cpu, updated = 0;
-	u64 cpu_idle, cpu_wall;
-	s64 diff_idle, diff_wall;
-	ssize_t ret;
+	struct usb_frontpanel *dev = usb_get_intfdata(to_usb_interface(d));
+	enum frontpanel_mode mode = READ_ONCE(dev->mode);
+	int i, len = 0;
 
-	for_each_online_cpu(cpu) {
-		struct rackmeter_cpu *rcpu;
-		if (cpu > 15)
-			continue;
-		rcpu = &dev->cpu[cpu];
+	for (i = 0; i < FP_MODE_COUNT; i++)
+		len += sysfs_emit_at(buf, len, i == mode ? "[%s] " : "%s ",
+				     frontpanel_mode_names[i]);
+	buf[len - 1] = '\n';
 
-		cpu_idle = get_cpu_idle_time(cpu, &cpu_wall, 0);
-		diff_idle = cpu_idle - rcpu->prev_idle;
-		diff_wall = cpu_wall - rcpu->prev_wall;
-		if (diff_idle > diff_wall)
-			diff_wall = diff_idle;
-	
-		/* We do a very dumb calculation to update the LEDs for now */
-		load = div64_u64(255 * (diff_wall - diff_idle), diff_wall);
+	return len;
+}
 
-		if (dev->buffer[cpu] != (__u8)load) {
-			dev->buffer[cpu] = (__u8)load;
-			updated = 1;
-		}
+static ssize_t mode_store(struct device *d, struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	struct usb_frontpanel *dev = usb_get_intfdata(to_usb_interface(d));
+	int mode, retval;
 
-		rcpu->prev_idle = cpu_idle;
-		rcpu->prev_wall = cpu_wall;
-	}
+	mode = sysfs_match_string(frontpanel_mode_names, buf);
+	if (mode < 0)
+		return mode;
 
-	if (updated) {
-		ret = frontpanel_write(dev, dev->buffer, PANEL_DATA_SIZE);
-		if (ret <= 0)
-			dev_err(&dev->interface->dev, "write failed: %ld\n", ret);
-	}
+	retval = frontpanel_set_mode(dev, mode);
 
-	schedule_delayed_work_on(smp_processor_id(), &dev->sniffer, msecs_to_jiffies(CPU_SAMPLING_RATE));
+	return retval ? retval : count;
 }
+static DEVICE_ATTR_RW(mode);
 
-static void rackmeter_init_cpu_sniffer(struct usb_frontpanel *dev)
+/* the CPUs shown in view mode, as a CPU list or nodeN */
+static ssize_t view_show(struct device *d, struct device_attribute *attr, char *buf)
 {
-	unsigned int cpu;
+	struct usb_frontpanel *dev = usb_get_intfdata(to_usb_interface(d));
+	ssize_t len;
 
-	INIT_DELAYED_WORK(&dev->sniffer, rackmeter_do_timer);
+	spin_lock(&dev->view_lock);
+	if (dev->view_node != NUMA_NO_NODE)
+		len = sysfs_emit(buf, "node%d\n", dev->view_node);
+	else
+		len = sysfs_emit(buf, "%*pbl\n", PANEL_MAX_CPUS, dev->view);
+	spin_unlock(&dev->view_lock);
 
-	for_each_online_cpu(cpu) {
-		struct rackmeter_cpu *rcpu;
-		if (cpu > 15)
-			continue;
-		rcpu = &dev->cpu[cpu];
+	return len;
+}
 
-		rcpu->prev_wall = 0;
-		rcpu->prev_idle = 0;
+static ssize_t view_store(struct device *d, struct device_attribute *attr,
+			  const char *buf, size_t count)
+{
+	struct usb_frontpanel *dev = usb_get_intfdata(to_usb_interface(d));
+	DECLARE_BITMAP(view, PANEL_MAX_CPUS);
+	int node = NUMA_NO_NODE, retval;
+
+	if (sscanf(buf, "node%d", &node) == 1) {
+		if (node < 0 || node >= MAX_NUMNODES || !node_online(node))
+			return -EINVAL;
+		rackmeter_view_node(view, node);
+	} else {
+		retval = bitmap_parselist(buf, view, PANEL_MAX_CPUS);
+		if (retval)
+			return retval;
+		rackmeter_view_trim(view);
 	}
+	if (bitmap_empty(view, PANEL_MAX_CPUS))
+		return -EINVAL;
 
-	schedule_delayed_work_on(smp_processor_id(), &dev->sniffer, msecs_to_jiffies(CPU_SAMPLING_RATE));
-}
+	spin_lock(&dev->view_lock);
+	bitmap_copy(dev->view, view, PANEL_MAX_CPUS);
+	dev->view_node = node;
+	dev->view_since = jiffies;
+	spin_unlock(&dev->view_lock);
 
+	return count;
+}
+static DEVICE_ATTR_RW(view);
 
-static void rackmeter_stop_cpu_sniffer(struct usb_frontpanel *dev)
+/* current write queue depth limit, frames in flight and the maximum */
+static ssize_t queue_depth_show(struct device *d, struct device_attribute *attr, char *buf)
 {
-	cancel_delayed_work_sync(&dev->sniffer);
+	struct usb_frontpanel *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sysfs_emit(buf, "%u %d %u\n", READ_ONCE(dev->depth),
+			  atomic_read(&dev->in_flight), WRITES_IN_FLIGHT);
 }
+static DEVICE_ATTR_RO(queue_depth);
+
+static struct attribute *frontpanel_attrs[] = {
+	&dev_attr_mode.attr,
+	&dev_attr_view.attr,
+	&dev_attr_queue_depth.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(frontpanel);
 
 static int frontpanel_probe(struct usb_interface *interface,
 		      const struct usb_device_id *id)
 {
 	struct usb_frontpanel *dev;
 	struct usb_endpoint_descriptor *bulk_out;
-	int retval;
+	int retval, i;
 
 	/* allocate memory for our device state and initialize it */
 	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
@@ -284,10 +2221,17 @@ static int frontpanel_probe(struct usb_interface *interface,
 		return -ENOMEM;
 
 	kref_init(&dev->kref);
-	sema_init(&dev->limit_sem, WRITES_IN_FLIGHT);
+	dev->depth = 1;
 	mutex_init(&dev->io_mutex);
-	spin_lock_init(&dev->err_lock);
 	init_usb_anchor(&dev->submitted);
+	init_usb_anchor(&dev->urgent);
+	INIT_DELAYED_WORK(&dev->release_held, frontpanel_release_held);
+	INIT_WORK(&dev->submit, frontpanel_submit);
+	spin_lock_init(&dev->view_lock);
+	bitmap_set(dev->view, 0, min(PANEL_CHANNELS, PANEL_MAX_CPUS));
+	dev->view_node = NUMA_NO_NODE;
+	for (i = 0; i < WRITES_IN_FLIGHT; i++)
+		dev->slot[i].dev = dev;
 
 	dev->udev = usb_get_dev(interface_to_usbdev(interface));
 	dev->interface = usb_get_intf(interface);
@@ -304,10 +2248,42 @@ static int frontpanel_probe(struct usb_interface *interface,
 
 	dev->bulk_out_endpointAddr = bulk_out->bEndpointAddress;
 
+	/*
+	 * without DMA there is nothing to map and kmalloc() is cheapest,
+	 * otherwise map once up front
+	 */
+	dev->buffers = READ_ONCE(fp_buffers);
+	if (dev->buffers == FP_BUF_AUTO)
+		dev->buffers = dev->udev->bus->uses_dma ? FP_BUF_POOL : FP_BUF_STREAMING;
+	if (dev->buffers == FP_BUF_POOL) {
+		dev->pool = usb_alloc_coherent(dev->udev,
+					       WRITES_IN_FLIGHT * PANEL_DATA_SIZE,
+					       GFP_KERNEL, &dev->pool_dma);
+		if (!dev->pool)
+			dev->buffers = FP_BUF_COHERENT;
+	}
+	dev_dbg(&interface->dev, "using %s frame buffers\n",
+		frontpanel_buffers_names[dev->buffers]);
+
 	/* save our data pointer in this interface device */
 	usb_set_intfdata(interface, dev);
 
 	rackmeter_init_cpu_sniffer(dev);
+	if (sched_hooks) {
+		retval = rackmeter_hooks_get();
+		if (retval)
+			dev_warn(&interface->dev,
+				 "cpufreq governors use the scheduler hooks, polling instead\n");
+		dev->hooked = !retval;
+	}
+
+	/* show the frame stashed by the previous instance until we have our own */
+	if (fp_stash_valid) {
+		memcpy(dev->buffer, fp_stash, PANEL_CHANNELS);
+		frontpanel_post(dev, dev->buffer, NULL, ktime_get(), false);
+	}
+
+	rackmeter_start_cpu_sniffer(dev);
 
 	return 0;
 
@@ -324,13 +2300,21 @@ static void frontpanel_disconnect(struct usb_interface *interface)
 	dev = usb_get_intfdata(interface);
 
 	rackmeter_stop_cpu_sniffer(dev);
+	frontpanel_set_mode(dev, FP_MODE_CPU);
 
 	/* prevent more I/O from starting */
 	mutex_lock(&dev->io_mutex);
 	dev->disconnected = 1;
 	mutex_unlock(&dev->io_mutex);
 
+	usb_kill_anchored_urbs(&dev->urgent);
 	usb_kill_anchored_urbs(&dev->submitted);
+	cancel_delayed_work_sync(&dev->release_held);
+	/* the completions may have queued it again */
+	cancel_work_sync(&dev->submit);
+
+	if (dev->hooked)
+		rackmeter_hooks_put();
 
 	/* decrement our usage count */
 	kref_put(&dev->kref, frontpanel_delete);
@@ -343,6 +2327,9 @@ static void frontpanel_draw_down(struct usb_frontpanel *dev)
 	time = usb_wait_anchor_empty_timeout(&dev->submitted, 1000);
 	if (!time)
 		usb_kill_anchored_urbs(&dev->submitted);
+	time = usb_wait_anchor_empty_timeout(&dev->urgent, 1000);
+	if (!time)
+		usb_kill_anchored_urbs(&dev->urgent);
 }
 
 static int frontpanel_suspend(struct usb_interface *intf, pm_message_t message)
@@ -351,12 +2338,18 @@ static int frontpanel_suspend(struct usb_interface *intf, pm_message_t message)
 
 	if (!dev)
 		return 0;
+	/* no new frames while the device is asleep */
+	rackmeter_stop_cpu_sniffer(dev);
 	frontpanel_draw_down(dev);
 	return 0;
 }
 
 static int frontpanel_resume(struct usb_interface *intf)
 {
+	struct usb_frontpanel *dev = usb_get_intfdata(intf);
+
+	if (dev)
+		rackmeter_start_cpu_sniffer(dev);
 	return 0;
 }
 
@@ -364,6 +2357,11 @@ static int frontpanel_pre_reset(struct usb_interface *intf)
 {
 	struct usb_frontpanel *dev = usb_get_intfdata(intf);
 
+	/*
+	 * the sniffer may be blocked on io_mutex in frontpanel_write(),
+	 * so it has to be stopped before we take the mutex ourselves
+	 */
+	rackmeter_stop_cpu_sniffer(dev);
 	mutex_lock(&dev->io_mutex);
 	frontpanel_draw_down(dev);
 
@@ -374,9 +2372,10 @@ static int frontpanel_post_reset(struct usb_interface *intf)
 {
 	struct usb_frontpanel *dev = usb_get_intfdata(intf);
 
-	/* we are sure no URBs are active - no locking needed */
-	dev->errors = -EPIPE;
+	/* we are sure no URBs are active */
+	atomic_set(&dev->errors, -EPIPE);
 	mutex_unlock(&dev->io_mutex);
+	rackmeter_start_cpu_sniffer(dev);
 
 	return 0;
 }
@@ -390,10 +2389,503 @@ static struct usb_driver frontpanel_driver = {
 	.pre_reset =	frontpanel_pre_reset,
 	.post_reset =	frontpanel_post_reset,
 	.id_table =	frontpanel_table,
+	.dev_groups =	frontpanel_groups,
 	/*.supports_autosuspend = 1,*/
 };
 
-module_usb_driver(frontpanel_driver);
+static void frontpanel_stats_sum(struct frontpanel_stats *sum)
+{
+	unsigned int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		struct frontpanel_stats *st = per_cpu_ptr(fp_stats, cpu);
+
+		sum->ticks += READ_ONCE(st->ticks);
+		sum->periods += READ_ONCE(st->periods);
+		sum->period_ns += READ_ONCE(st->period_ns);
+		sum->sample_ns += READ_ONCE(st->sample_ns);
+		sum->skew_ns += READ_ONCE(st->skew_ns);
+		sum->skew_max_ns = max(sum->skew_max_ns, READ_ONCE(st->skew_max_ns));
+		sum->frames_rendered += READ_ONCE(st->frames_rendered);
+		sum->frames_suppressed += READ_ONCE(st->frames_suppressed);
+		sum->frames_submitted += READ_ONCE(st->frames_submitted);
+		sum->submit_ns += READ_ONCE(st->submit_ns);
+		sum->completions += READ_ONCE(st->completions);
+		sum->complete_ns += READ_ONCE(st->complete_ns);
+		sum->frames_dropped += READ_ONCE(st->frames_dropped);
+		sum->urb_errors += READ_ONCE(st->urb_errors);
+		sum->alerts += READ_ONCE(st->alerts);
+		sum->depth_increases += READ_ONCE(st->depth_increases);
+		sum->depth_decreases += READ_ONCE(st->depth_decreases);
+		sum->frames_unlinked += READ_ONCE(st->frames_unlinked);
+		sum->urgent_frames += READ_ONCE(st->urgent_frames);
+		sum->urgent_us += READ_ONCE(st->urgent_us);
+		for (i = 0; i < LATENCY_BUCKETS; i++)
+			sum->latency[i] += READ_ONCE(st->latency[i]);
+		sum->latency_ns += READ_ONCE(st->latency_ns);
+	}
+}
+
+static int frontpanel_stats_show(struct seq_file *m, void *v)
+{
+	struct frontpanel_stats sum;
+
+	frontpanel_stats_sum(&sum);
+
+	seq_printf(m, "ticks: %llu\n", sum.ticks);
+	seq_printf(m, "sample_ns: %llu\n", sum.sample_ns);
+	seq_printf(m, "ns_per_tick: %llu\n",
+		   sum.ticks ? div64_u64(sum.sample_ns, sum.ticks) : 0);
+	seq_printf(m, "ns_per_period: %llu\n",
+		   sum.periods ? div64_u64(sum.period_ns, sum.periods) : 0);
+	seq_printf(m, "skew_avg_ns: %llu\n",
+		   sum.ticks ? div64_u64(sum.skew_ns, sum.ticks) : 0);
+	seq_printf(m, "skew_max_ns: %llu\n", sum.skew_max_ns);
+	seq_printf(m, "frames_rendered: %llu\n", sum.frames_rendered);
+	seq_printf(m, "frames_suppressed: %llu\n", sum.frames_suppressed);
+	seq_printf(m, "frames_submitted: %llu\n", sum.frames_submitted);
+	seq_printf(m, "ns_per_submit: %llu\n",
+		   sum.frames_submitted ? div64_u64(sum.submit_ns, sum.frames_submitted) : 0);
+	seq_printf(m, "ns_per_complete: %llu\n",
+		   sum.completions ? div64_u64(sum.complete_ns, sum.completions) : 0);
+	seq_printf(m, "frames_dropped: %llu\n", sum.frames_dropped);
+	seq_printf(m, "urb_errors: %llu\n", sum.urb_errors);
+	seq_printf(m, "alerts: %llu\n", sum.alerts);
+	seq_printf(m, "depth_increases: %llu\n", sum.depth_increases);
+	seq_printf(m, "depth_decreases: %llu\n", sum.depth_decreases);
+	seq_printf(m, "frames_unlinked: %llu\n", sum.frames_unlinked);
+	seq_printf(m, "urgent_frames: %llu\n", sum.urgent_frames);
+	seq_printf(m, "us_per_urgent: %llu\n",
+		   sum.urgent_frames ? div64_u64(sum.urgent_us, sum.urgent_frames) : 0);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(frontpanel_stats);
+
+static int frontpanel_latency_show(struct seq_file *m, void *v)
+{
+	struct frontpanel_stats sum;
+	unsigned int i;
+
+	frontpanel_stats_sum(&sum);
+
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+		seq_printf(m, "%s%6lu us: %llu\n",
+			   i == LATENCY_BUCKETS - 1 ? "> " : "<=",
+			   i == LATENCY_BUCKETS - 1 ? 1UL << (i - 1) : 1UL << i,
+			   sum.latency[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(frontpanel_latency);
+
+/*
+ * /proc/driver/xserve-frontpanel: everything above in OpenMetrics text
+ * format, for node_exporter's textfile collector and the like. One pass
+ * over the per-CPU counters, no locks.
+ */
+static void fp_om_counter(struct seq_file *m, const char *name, const char *help, u64 val)
+{
+	seq_printf(m, "# TYPE xserve_panel_%s counter\n", name);
+	seq_printf(m, "# HELP xserve_panel_%s %s.\n", name, help);
+	seq_printf(m, "xserve_panel_%s_total %llu\n", name, val);
+}
+
+static void fp_om_seconds(struct seq_file *m, const char *name, const char *help, u64 ns)
+{
+	u32 rem;
+	u64 s = div_u64_rem(ns, NSEC_PER_SEC, &rem);
+
+	seq_printf(m, "# TYPE xserve_panel_%s_seconds counter\n", name);
+	seq_printf(m, "# UNIT xserve_panel_%s_seconds seconds\n", name);
+	seq_printf(m, "# HELP xserve_panel_%s_seconds %s.\n", name, help);
+	seq_printf(m, "xserve_panel_%s_seconds_total %llu.%09u\n", name, s, rem);
+}
+
+static int frontpanel_metrics_show(struct seq_file *m, void *v)
+{
+	struct frontpanel_stats sum;
+	u64 count = 0;
+	unsigned int i;
+	u32 rem;
+	u64 s;
+
+	frontpanel_stats_sum(&sum);
+
+	fp_om_counter(m, "ticks", "Sampler runs", sum.ticks);
+	fp_om_seconds(m, "sample", "Time spent sampling the CPUs", sum.sample_ns);
+	fp_om_seconds(m, "skew", "First to last CPU read within a tick", sum.skew_ns);
+
+	/* the effective sampling period, as a summary of the tick intervals */
+	s = div_u64_rem(sum.period_ns, NSEC_PER_SEC, &rem);
+	seq_puts(m, "# TYPE xserve_panel_period_seconds summary\n");
+	seq_puts(m, "# UNIT xserve_panel_period_seconds seconds\n");
+	seq_puts(m, "# HELP xserve_panel_period_seconds Time between sampler runs.\n");
+	seq_printf(m, "xserve_panel_period_seconds_count %llu\n", sum.periods);
+	seq_printf(m, "xserve_panel_period_seconds_sum %llu.%09u\n", s, rem);
+
+	fp_om_counter(m, "frames_rendered", "Frames rendered", sum.frames_rendered);
+	fp_om_counter(m, "frames_suppressed", "Frames identical to the last one, not sent",
+		      sum.frames_suppressed);
+	fp_om_counter(m, "frames_submitted", "Frames submitted to the panel", sum.frames_submitted);
+	fp_om_seconds(m, "submit", "Time spent submitting frames", sum.submit_ns);
+	fp_om_seconds(m, "complete", "Time spent handling frame completions", sum.complete_ns);
+	fp_om_counter(m, "frames_dropped", "Frames that could not be submitted",
+		      sum.frames_dropped);
+	fp_om_counter(m, "frames_unlinked", "Queued frames unlinked for an urgent one",
+		      sum.frames_unlinked);
+	fp_om_counter(m, "urb_errors", "URBs completed with an error", sum.urb_errors);
+	fp_om_counter(m, "alerts", "CPUs flagged as anomalous", sum.alerts);
+	fp_om_counter(m, "depth_increases", "Write queue depth increases", sum.depth_increases);
+	fp_om_counter(m, "depth_decreases", "Write queue depth decreases", sum.depth_decreases);
+	fp_om_counter(m, "urgent_frames", "Urgent frames acknowledged", sum.urgent_frames);
+	fp_om_seconds(m, "urgent_latency", "Sampling to acknowledgement of urgent frames",
+		      sum.urgent_us * NSEC_PER_USEC);
+
+	/* buckets are cumulative here, bucket i ends at 2^i us inclusive */
+	seq_puts(m, "# TYPE xserve_panel_latency_seconds histogram\n");
+	seq_puts(m, "# UNIT xserve_panel_latency_seconds seconds\n");
+	seq_puts(m, "# HELP xserve_panel_latency_seconds Sampling to acknowledgement of a frame.\n");
+	for (i = 0; i < LATENCY_BUCKETS - 1; i++) {
+		count += sum.latency[i];
+		seq_printf(m, "xserve_panel_latency_seconds_bucket{le=\"%lu.%06lu\"} %llu\n",
+			   (1UL << i) / USEC_PER_SEC, (1UL << i) % USEC_PER_SEC, count);
+	}
+	count += sum.latency[i];
+	seq_printf(m, "xserve_panel_latency_seconds_bucket{le=\"+Inf\"} %llu\n", count);
+	seq_printf(m, "xserve_panel_latency_seconds_count %llu\n", count);
+	s = div_u64_rem(sum.latency_ns, NSEC_PER_SEC, &rem);
+	seq_printf(m, "xserve_panel_latency_seconds_sum %llu.%09u\n", s, rem);
+
+	seq_puts(m, "# EOF\n");
+
+	return 0;
+}
+
+static ssize_t frontpanel_loadlog_read(struct file *file, char __user *ubuf,
+				      size_t count, loff_t *ppos)
+{
+	struct rackmeter_logrec rec;
+	char line[64];
+	ssize_t done = 0;
+	int len;
+
+	if (mutex_lock_interruptible(&fp_loadlog_lock))
+		return -ERESTARTSYS;
+
+	/* one "wall_us cpu window_us busy_us load poll|hook" line per record */
+	while (kfifo_peek(&fp_loadlog, &rec)) {
+		len = scnprintf(line, sizeof(line), "%llu %u %u %u %u %s\n",
+				rec.wall_us, rec.cpu, rec.window_us,
+				rec.busy_us, rec.load, rec.hook ? "hook" : "poll");
+		if (done + len > count)
+			break;
+		if (copy_to_user(ubuf + done, line, len)) {
+			if (!done)
+				done = -EFAULT;
+			break;
+		}
+		kfifo_skip(&fp_loadlog);
+		done += len;
+	}
+
+	mutex_unlock(&fp_loadlog_lock);
+
+	return done;
+}
+
+static const struct file_operations frontpanel_loadlog_fops = {
+	.owner = THIS_MODULE,
+	.open = nonseekable_open,
+	.read = frontpanel_loadlog_read,
+};
+
+/* the raw ring, at most a chunk per read so each chunk is copied whole */
+static ssize_t frontpanel_history_read(struct file *file, char __user *ubuf,
+				       size_t count, loff_t *ppos)
+{
+	loff_t pos = *ppos;
+	ssize_t retval;
+	size_t n;
+	void *bounce;
+
+	if (pos < 0)
+		return -EINVAL;
+	if (!fp_history.buf || pos >= HISTORY_CHUNKS * HISTORY_CHUNK_SIZE)
+		return 0;
+	n = min_t(size_t, count, HISTORY_CHUNK_SIZE - pos % HISTORY_CHUNK_SIZE);
+
+	bounce = kmalloc(n, GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+
+	mutex_lock(&fp_history_lock);
+	memcpy(bounce, fp_history.buf + pos, n);
+	mutex_unlock(&fp_history_lock);
+
+	if (copy_to_user(ubuf, bounce, n)) {
+		retval = -EFAULT;
+	} else {
+		*ppos = pos + n;
+		retval = n;
+	}
+	kfree(bounce);
+
+	return retval;
+}
+
+static const struct file_operations frontpanel_history_fops = {
+	.owner = THIS_MODULE,
+	.read = frontpanel_history_read,
+	.llseek = default_llseek,
+};
+
+#ifdef CONFIG_PERF_EVENTS
+/*
+ * The counters as a software perf PMU, e.g.
+ * "perf stat -a -e xserve_panel/frames_submitted/". Each event counts the
+ * per-CPU slot of the CPU it is opened on, so system-wide counts add up.
+ * There is no interrupt to sample on, only counting is supported.
+ */
+static const size_t fp_pmu_counters[] = {
+	offsetof(struct frontpanel_stats, ticks),
+	offsetof(struct frontpanel_stats, frames_rendered),
+	offsetof(struct frontpanel_stats, frames_submitted),
+	offsetof(struct frontpanel_stats, frames_suppressed),
+	offsetof(struct frontpanel_stats, frames_dropped),
+	offsetof(struct frontpanel_stats, urb_errors),
+	offsetof(struct frontpanel_stats, sample_ns),
+	offsetof(struct frontpanel_stats, submit_ns),
+	offsetof(struct frontpanel_stats, complete_ns),
+};
+
+PMU_FORMAT_ATTR(event, "config:0-7");
+
+static struct attribute *frontpanel_pmu_format_attrs[] = {
+	&format_attr_event.attr,
+	NULL
+};
+
+static const struct attribute_group frontpanel_pmu_format_group = {
+	.name = "format",
+	.attrs = frontpanel_pmu_format_attrs,
+};
+
+PMU_EVENT_ATTR_STRING(ticks, fp_pmu_ticks, "event=0x00");
+PMU_EVENT_ATTR_STRING(frames_rendered, fp_pmu_frames_rendered, "event=0x01");
+PMU_EVENT_ATTR_STRING(frames_submitted, fp_pmu_frames_submitted, "event=0x02");
+PMU_EVENT_ATTR_STRING(frames_suppressed, fp_pmu_frames_suppressed, "event=0x03");
+PMU_EVENT_ATTR_STRING(frames_dropped, fp_pmu_frames_dropped, "event=0x04");
+PMU_EVENT_ATTR_STRING(urb_errors, fp_pmu_urb_errors, "event=0x05");
+PMU_EVENT_ATTR_STRING(sample_ns, fp_pmu_sample_ns, "event=0x06");
+PMU_EVENT_ATTR_STRING(submit_ns, fp_pmu_submit_ns, "event=0x07");
+PMU_EVENT_ATTR_STRING(complete_ns, fp_pmu_complete_ns, "event=0x08");
+
+static struct attribute *frontpanel_pmu_events_attrs[] = {
+	&fp_pmu_ticks.attr.attr,
+	&fp_pmu_frames_rendered.attr.attr,
+	&fp_pmu_frames_submitted.attr.attr,
+	&fp_pmu_frames_suppressed.attr.attr,
+	&fp_pmu_frames_dropped.attr.attr,
+	&fp_pmu_urb_errors.attr.attr,
+	&fp_pmu_sample_ns.attr.attr,
+	&fp_pmu_submit_ns.attr.attr,
+	&fp_pmu_complete_ns.attr.attr,
+	NULL
+};
+
+static const struct attribute_group frontpanel_pmu_events_group = {
+	.name = "events",
+	.attrs = frontpanel_pmu_events_attrs,
+};
+
+static const struct attribute_group *frontpanel_pmu_attr_groups[] = {
+	&frontpanel_pmu_format_group,
+	&frontpanel_pmu_events_group,
+	NULL
+};
+
+static u64 frontpanel_pmu_counter(struct perf_event *event)
+{
+	void *st = per_cpu_ptr(fp_stats, event->cpu);
+
+	return READ_ONCE(*(u64 *)(st + fp_pmu_counters[event->attr.config]));
+}
+
+static int frontpanel_pmu_event_init(struct perf_event *event)
+{
+	if (event->attr.type != event->pmu->type)
+		return -ENOENT;
+	if (event->attr.config >= ARRAY_SIZE(fp_pmu_counters))
+		return -EINVAL;
+	/* counting only, and only per CPU */
+	if (is_sampling_event(event) || event->cpu < 0)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void frontpanel_pmu_update(struct perf_event *event)
+{
+	u64 prev, now;
+
+	do {
+		prev = local64_read(&event->hw.prev_count);
+		now = frontpanel_pmu_counter(event);
+	} while (local64_cmpxchg(&event->hw.prev_count, prev, now) != prev);
+
+	local64_add(now - prev, &event->count);
+}
+
+static void frontpanel_pmu_start(struct perf_event *event, int flags)
+{
+	local64_set(&event->hw.prev_count, frontpanel_pmu_counter(event));
+	event->hw.state = 0;
+}
+
+static void frontpanel_pmu_stop(struct perf_event *event, int flags)
+{
+	if (event->hw.state & PERF_HES_STOPPED)
+		return;
+	frontpanel_pmu_update(event);
+	event->hw.state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+}
+
+static int frontpanel_pmu_add(struct perf_event *event, int flags)
+{
+	event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+	if (flags & PERF_EF_START)
+		frontpanel_pmu_start(event, flags);
+
+	return 0;
+}
+
+static void frontpanel_pmu_del(struct perf_event *event, int flags)
+{
+	frontpanel_pmu_stop(event, PERF_EF_UPDATE);
+}
+
+static struct pmu frontpanel_pmu = {
+	.module		= THIS_MODULE,
+	.task_ctx_nr	= perf_invalid_context,
+	.attr_groups	= frontpanel_pmu_attr_groups,
+	.capabilities	= PERF_PMU_CAP_NO_INTERRUPT | PERF_PMU_CAP_NO_EXCLUDE,
+	.event_init	= frontpanel_pmu_event_init,
+	.add		= frontpanel_pmu_add,
+	.del		= frontpanel_pmu_del,
+	.start		= frontpanel_pmu_start,
+	.stop		= frontpanel_pmu_stop,
+	.read		= frontpanel_pmu_update,
+};
+
+static bool fp_pmu_registered;
+
+static void frontpanel_pmu_register(void)
+{
+	int retval = perf_pmu_register(&frontpanel_pmu, "xserve_panel", -1);
+
+	/* not fatal, the panel works without it */
+	if (retval)
+		pr_warn("xserve-frontpanel: perf PMU registration failed: %d\n", retval);
+	fp_pmu_registered = !retval;
+}
+
+static void frontpanel_pmu_unregister(void)
+{
+	if (fp_pmu_registered)
+		perf_pmu_unregister(&frontpanel_pmu);
+}
+#else
+static void frontpanel_pmu_register(void) { }
+static void frontpanel_pmu_unregister(void) { }
+#endif
+
+static int __init frontpanel_init(void)
+{
+	int retval;
+
+	fp_stats = alloc_percpu(struct frontpanel_stats);
+	if (!fp_stats)
+		return -ENOMEM;
+
+	fp_wq = alloc_workqueue("xserve-frontpanel", WQ_HIGHPRI, 0);
+	if (!fp_wq) {
+		free_percpu(fp_stats);
+		return -ENOMEM;
+	}
+
+	/* runs for the CPUs already online, too */
+	retval = cpuhp_setup_state(CPUHP_AP_ONLINE_DYN, "usb/xserve-frontpanel:online",
+				   frontpanel_cpu_online, NULL);
+	if (retval < 0) {
+		destroy_workqueue(fp_wq);
+		free_percpu(fp_stats);
+		return retval;
+	}
+	fp_cpuhp = retval;
+
+	fp_debugfs = debugfs_create_dir("xserve-frontpanel", NULL);
+	debugfs_create_file("stats", 0444, fp_debugfs, NULL,
+			    &frontpanel_stats_fops);
+	debugfs_create_file("latency", 0444, fp_debugfs, NULL,
+			    &frontpanel_latency_fops);
+	debugfs_create_bool("loadlog_enable", 0644, fp_debugfs, &fp_loadlog_enable);
+	debugfs_create_file("loadlog", 0400, fp_debugfs, NULL,
+			    &frontpanel_loadlog_fops);
+	if (history)
+		fp_history.buf = vzalloc(HISTORY_CHUNKS * HISTORY_CHUNK_SIZE);
+	if (fp_history.buf)
+		debugfs_create_file_size("history", 0400, fp_debugfs, NULL,
+					 &frontpanel_history_fops,
+					 HISTORY_CHUNKS * HISTORY_CHUNK_SIZE);
+
+#ifdef CONFIG_FAULT_INJECTION_DEBUG_FS
+	fault_create_debugfs_attr("fail_urb_alloc", fp_debugfs, &fp_fail_urb_alloc);
+	fault_create_debugfs_attr("fail_submit", fp_debugfs, &fp_fail_submit);
+	fault_create_debugfs_attr("fail_completion", fp_debugfs, &fp_fail_completion);
+	fault_create_debugfs_attr("delay_completion", fp_debugfs, &fp_delay_completion);
+	debugfs_create_u32("fail_completion_errno", 0644, fp_debugfs,
+			   &fp_fail_completion_errno);
+	debugfs_create_u32("delay_completion_ms", 0644, fp_debugfs,
+			   &fp_delay_completion_ms);
+#endif
+
+	rackmeter_policy_register();
+	frontpanel_pmu_register();
+	frontpanel_kfunc_register();
+	proc_create_single("driver/xserve-frontpanel", 0444, NULL, frontpanel_metrics_show);
+
+	retval = usb_register(&frontpanel_driver);
+	if (retval) {
+		remove_proc_entry("driver/xserve-frontpanel", NULL);
+		frontpanel_pmu_unregister();
+		rackmeter_policy_unregister();
+		debugfs_remove_recursive(fp_debugfs);
+		vfree(fp_history.buf);
+		cpuhp_remove_state(fp_cpuhp);
+		destroy_workqueue(fp_wq);
+		free_percpu(fp_stats);
+	}
+
+	return retval;
+}
+
+static void __exit frontpanel_exit(void)
+{
+	usb_deregister(&frontpanel_driver);
+	remove_proc_entry("driver/xserve-frontpanel", NULL);
+	frontpanel_pmu_unregister();
+	rackmeter_policy_unregister();
+	debugfs_remove_recursive(fp_debugfs);
+	vfree(fp_history.buf);
+	cpuhp_remove_state(fp_cpuhp);
+	destroy_workqueue(fp_wq);
+	free_percpu(fp_stats);
+}
+
+module_init(frontpanel_init);
+module_exit(frontpanel_exit);
 
 MODULE_AUTHOR("RenÃ© Rebe");
 MODULE_DESCRIPTION("Apple Xserve USB front-panel driver");
@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Apple Xserve USB front-panel driver, interface for other kernel code.
+ *
+ * The CPU loads of the last cpu mode tick, 0 (idle) to 255 (busy), over
+ * the last sampling period or averaged over the last seconds. Lockless,
+ * callable from any context.
+ */
+#ifndef _XSERVE_FRONTPANEL_H
+#define _XSERVE_FRONTPANEL_H
+
+#include <linux/types.h>
+
+/*
+ * One CPU's load, -EINVAL for a CPU the panel doesn't sample, -ENODATA when
+ * no panel sampled CPU loads lately.
+ */
+int xserve_panel_cpu_load(unsigned int cpu, bool avg);
+
+/*
+ * The loads of CPUs 0 to nr - 1, all from the same tick, into load and avg
+ * (either may be NULL) and the tick's CLOCK_MONOTONIC time into stamp_ns
+ * (may be NULL). Returns how many CPUs were copied, fewer than nr beyond
+ * the CPUs the panel samples, or -ENODATA.
+ */
+int xserve_panel_cpu_loads(u8 *load, u8 *avg, unsigned int nr, u64 *stamp_ns);
+
+#endif /* _XSERVE_FRONTPANEL_H */